@@ -0,0 +1,37 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "container.h"
+
+#include <stdio.h>
+
+#define ARCHIVE_MAGIC "HFAR"
+
+// struct for an entry of the archive index
+struct archive_entry {
+    char *name;         // member name, as given on creation
+    uint64_t size;      // uncompressed size in bytes
+    uint64_t offset;    // position of the member's container within the archive
+    uint64_t length;    // size of the member's container in bytes
+};
+
+// struct for an archive opened for reading
+struct archive {
+    FILE *file;                     // archive file
+    struct archive_entry *entries;  // member index
+    uint64_t count;                 // number of members
+};
+
+// function that packs the given files into a new archive at path; every file
+// is a task and every block of every file is a nested task on the same thread pool
+int archive_create(const char *path, char **filenames, size_t count, uint32_t block_size);
+// function that opens an archive and loads its index; returns NULL on failure
+struct archive* archive_open(const char *path);
+// function that closes an archive
+void archive_close(struct archive *p);
+// function that returns the index of the member with the given name, or -1
+int64_t archive_find(struct archive *p, const char *name);
+// function that decodes a single member into file without touching the others
+int archive_extract(struct archive *p, uint64_t idx, FILE *file);
+
+#endif
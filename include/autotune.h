@@ -0,0 +1,43 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AUTOTUNE_CACHE_DIR "huffman-parallel"
+#define AUTOTUNE_CACHE_FILE "autotune"
+#define AUTOTUNE_BENCH_SIZE (1024 * 1024)
+#define AUTOTUNE_MIN_BLOCK_SIZE (16 * 1024)
+#define AUTOTUNE_BLOCKS_PER_THREAD 4
+// parallel regions entered by one compression (histogram, encode, finish)
+#define AUTOTUNE_REGIONS 3
+
+// struct for the calibrated cost model: compressing n bytes with t threads is
+// estimated to take n * byte_cost / t, plus t * (spawn_cost + regions * fork_cost)
+// when t > 1 (t = 1 runs without any parallel region)
+struct autotune {
+    int max_threads;        // threads available when calibrated
+    double byte_cost;       // seconds per byte for histogram + encode on one thread
+    double spawn_cost;      // seconds per thread to start the thread pool (cold)
+    double fork_cost;       // seconds per thread to enter a parallel region (warm)
+};
+
+// struct for the parameters picked for a given input
+struct autotune_plan {
+    int threads;            // 1 means the serial path
+    uint32_t block_size;    // uncompressed bytes per block (checkpoint interval)
+    double estimated;       // estimated compression time, in seconds
+};
+
+// function that loads the cost model from the on-disk cache, or calibrates it
+// with a micro-benchmark and caches it; to measure the cold thread spin-up it
+// must run before any other parallel region of the process
+struct autotune* autotune_load();
+// function that frees a cost model
+void autotune_destroy(struct autotune *p);
+// function that picks the thread count and block size for an input of the given size
+struct autotune_plan autotune_plan(struct autotune *p, size_t size);
+// function that returns the smallest input size for which the model uses more than one thread
+size_t autotune_serial_cutoff(struct autotune *p);
+
+#endif
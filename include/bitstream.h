@@ -0,0 +1,50 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// extra zeroed bytes allocated past the end of every buffer, so that
+// pushes and peeks may touch a few bytes beyond the current offset
+#define BITSTREAM_PADDING 8
+
+// struct for the bitstream that will hold the final Huffman code
+struct bitstream {
+    uint8_t *buf;
+    size_t capacity;    // buffer size in bytes
+
+    uint64_t length;    // in bits
+    uint64_t offset;    // current offset (in bits) into the stream
+};
+
+// function that creates a new bitstream with room for capacity bytes
+struct bitstream* bitstream_new(size_t capacity);
+// function that frees a bitstream
+void bitstream_destroy(struct bitstream *p);
+// function that pushes the bit_length lowest bits of chunk (at most 32) to the stream
+void bitstream_push_chunk(struct bitstream *p, uint32_t chunk, uint8_t bit_length);
+// function that appends the contents of q to the end of p
+void bitstream_append(struct bitstream *p, struct bitstream *q);
+// function that returns the stream size in bytes (rounding up the last byte)
+size_t bitstream_size(struct bitstream *p);
+// auxiliary function that prints a bitstream
+void bitstream_print(struct bitstream *p);
+
+// function that returns the 32 bits starting at bit_offset in buf (MSB first);
+// buf must be followed by at least BITSTREAM_PADDING readable bytes
+static inline uint32_t bitstream_peek(const uint8_t *buf, uint64_t bit_offset) {
+    const uint8_t *b = buf + bit_offset / 8;
+    uint64_t window;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // one unaligned 8-byte load instead of five byte loads
+    memcpy(&window, b, sizeof(window));
+    window = __builtin_bswap64(window);
+#else
+    window = ((uint64_t) b[0] << 56) | ((uint64_t) b[1] << 48) |
+             ((uint64_t) b[2] << 40) | ((uint64_t) b[3] << 32) | ((uint64_t) b[4] << 24);
+#endif
+    return (uint32_t) (window >> (32 - bit_offset % 8));
+}
+
+#endif
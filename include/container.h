@@ -0,0 +1,104 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include "huffman.h"
+#include "bitstream.h"
+
+#include <stdio.h>
+
+#define CONTAINER_MAGIC "HFC4"
+#define CONTAINER_DEFAULT_BLOCK_SIZE (256 * 1024)
+#define CONTAINER_SAMPLE_WINDOW 4096
+// bytes checksummed at a time, interleaved with encoding and decoding so
+// each chunk is still in L1 when the other loop reads it
+#define CONTAINER_CHECKSUM_CHUNK 4096
+
+// enum used for describing how a block is stored
+enum block_mode {
+    BLOCK_HUFFMAN = 0,  // Huffman coded with the shared table
+    BLOCK_RAW = 1,      // stored as is
+    BLOCK_RLE = 2,      // (symbol, 32-bit run length) pairs
+    BLOCK_LZ77 = 3,     // LZ77 with its own Huffman tables (see lz77.h)
+};
+
+// bytes taken by each run of a BLOCK_RLE block
+#define CONTAINER_RLE_RUN_SIZE 5
+// a block is only Huffman (or LZ77) coded if that saves at least 1/CONTAINER_MIN_GAIN
+// of its size; below that, the slower decode is not worth the few saved bytes
+#define CONTAINER_MIN_GAIN 32
+
+// struct for a block-indexed Huffman stream: the input is cut into blocks of
+// block_size bytes which share one canonical code table but are encoded
+// independently, so each of them can be produced and decoded on its own;
+// the block offsets double as a sparse checkpoint index for random access,
+// and every block carries the CRC32C of its uncompressed bytes (the header
+// and index carry one of their own)
+struct container {
+    uint64_t size;              // uncompressed size in bytes
+    uint32_t block_size;        // uncompressed bytes per block (the last one may be shorter)
+    uint64_t block_count;       // number of blocks
+    int lz77;                   // whether blocks may be LZ77 coded (encoding only)
+    int threads;                // threads container_finish may use; 1 keeps it serial
+
+    struct hfcode dict[256];    // canonical code table shared by every block
+    struct hfdecoder *decoder;  // decoder for dict, available once the code is known
+
+    uint64_t *histograms;       // per-block symbol counts, possibly sampled (encoding only)
+    uint64_t *runs;             // per-block number of runs of equal symbols (encoding only)
+    struct bitstream **blocks;  // per-block encoded streams (encoding only)
+
+    uint8_t *modes;             // how each block is stored (enum block_mode)
+    uint64_t *offsets;          // byte offset of each block in the payload (block_count + 1 entries)
+    uint32_t *checksums;        // CRC32C of each uncompressed block
+    uint8_t *payload;           // concatenated blocks, each starting on a byte boundary
+};
+
+// function that creates an empty container for an input of the given size
+struct container* container_new(uint64_t size, uint32_t block_size);
+// function that frees a container
+void container_destroy(struct container *p);
+
+// function that counts the symbols (and runs) of a given block of the input
+// and computes its checksum
+void container_count_block(struct container *p, const uint8_t *in, uint64_t block);
+// function that counts only a subset of a given block: one window of
+// CONTAINER_SAMPLE_WINDOW bytes at a random offset in every stride bytes
+void container_sample_block(struct container *p, const uint8_t *in, uint64_t block, uint64_t stride);
+// function that builds the shared code table once every block has been counted;
+// if the histograms were sampled, every symbol gets a nonzero count so that
+// symbols missed by the sample can still be encoded
+void container_build_code(struct container *p);
+// function that encodes a given block of the input; with an exact histogram the
+// cheapest of Huffman, raw and RLE is picked before encoding, from the exact sizes;
+// if lz77 is set, the block is also LZ77 coded and kept that way when smaller;
+// the checksum of a sampled block is computed along the way
+void container_encode_block(struct container *p, const uint8_t *in, uint64_t block);
+// function that concatenates the encoded blocks into the payload
+void container_finish(struct container *p);
+// function that runs the whole encoding, one task per block; when called from
+// inside a parallel region the tasks go to the enclosing thread pool
+void container_compress(struct container *p, const uint8_t *in);
+
+// function that returns the uncompressed size of a given block
+uint64_t container_block_length(struct container *p, uint64_t block);
+// function that decodes a given block into out and verifies its checksum;
+// returns 0 on success and -1 if the block is corrupted
+int container_decode_block(struct container *p, uint64_t block, uint8_t *out);
+// function that decodes and verifies every block (in parallel) into out;
+// returns the number of corrupted blocks, and if corrupted is not NULL
+// (block_count entries) flags each of them there
+int64_t container_decode(struct container *p, uint8_t *out, uint8_t *corrupted);
+// function that decodes the len bytes starting at uncompressed offset off into out;
+// only the blocks covering the range are touched (and verified, so they are
+// decoded whole), so the cost is O(len + block_size); returns like container_decode,
+// and only the entries of corrupted for the blocks covering the range are set;
+// returns -1 without decoding anything if the range does not fit in the input
+int64_t container_decompress_range(struct container *p, uint64_t off, uint64_t len,
+                                   uint8_t *out, uint8_t *corrupted);
+
+// function that serializes a finished container
+void container_write(struct container *p, FILE *file);
+// function that reads a container from the current position of file; returns NULL on failure
+struct container* container_read(FILE *file);
+
+#endif
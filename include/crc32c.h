@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// function that extends a CRC32C (Castagnoli) checksum with len more bytes;
+// start from 0, and feeding a buffer in pieces gives the same result as in one go.
+// Uses the SSE4.2 crc32 instruction when the cpu has it, a lookup table otherwise
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buf, size_t len);
+
+#endif
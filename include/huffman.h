@@ -2,8 +2,13 @@
 #define HUFFMAN_H
 
 #include "minheap.h" // minheap, node
+#include "bitstream.h"
 #include <stdint.h>
 
+// longest code we are willing to emit; longer trees get their frequencies
+// flattened until they fit (this keeps every code within a single bitstream push)
+#define HFCODE_MAX_BITS 24
+
 // struct for the Huffman tree
 struct hftree {
     struct node *root;          // pointer to the tree root
@@ -14,18 +19,79 @@ struct hftree {
 
 // struct for the Huffman code
 struct hfcode {
-    uint8_t code;       // code for a given symbol
+    uint32_t code;      // code for a given symbol
     uint8_t bit_length; // length of the code
 };
 
+// bytes of L1 we allow the primary decode table to take (32-bit entries, so
+// 8 KiB gives an 11-bit table and leaves room for the streams on a 32 KiB L1d)
+#define HFDECODER_L1_BUDGET (8 * 1024)
+
+// layout of a decode table entry: symbol in the low 16 bits and the total code
+// length in the next 8; link entries instead hold the offset of a second-level
+// table (low 24 bits) and its width (bits 24-28)
+#define HFDECODER_LINK (1u << 31)
+
+// struct for the table-driven Huffman decoder: codes up to table_bits long are
+// resolved with a single lookup in the primary table, longer (rare) codes go
+// through a second-level table sized to the longest code sharing their prefix
+struct hfdecoder {
+    uint8_t table_bits;     // width of the primary table
+    uint32_t size;          // total number of entries (primary + second level)
+    uint32_t *table;        // packed entries, primary table first
+};
+
 // function that creates a Huffman tree, given a frequency array
 struct hftree* hftree_new(uint64_t frequencies[256]);
 // function that frees the Huffman tree
 void hftree_destroy(struct hftree *p);
 
-// function that generates the dict that represents the code table
+// function that generates the dict that represents the code table;
+// the codes are canonical, so the bit lengths alone describe the whole table
 void hftree_generate_dict(struct hftree *p, struct hfcode dict[256]);
 // auxiliary function to print the Huffman tree
 void hftree_print(struct hftree *p);
 
+// function that computes length-limited code lengths for an alphabet of n symbols
+// (up to 65536) without building a tree: the symbols are sorted by frequency
+// (in parallel) and the lengths are computed in place, in O(n) after the sort
+void hflengths_build(const uint64_t *frequencies, size_t n, uint8_t *lengths, uint8_t max_bits);
+// function that checks code lengths read from untrusted input: every length is at
+// most max_bits (itself at most HFCODE_MAX_BITS) and the Kraft sum is at most 1,
+// so the lengths describe a (possibly incomplete) prefix code; returns 1 if so
+int hflengths_valid(const uint8_t *lengths, size_t n, uint8_t max_bits);
+
+// function that assigns canonical codes to a dict of n symbols whose bit lengths are already set
+void hfcode_canonicalize(struct hfcode *dict, size_t n);
+
+// function that creates a decoder from the code lengths of a canonical dict of n
+// symbols, with the widest primary table that fits in HFDECODER_L1_BUDGET
+struct hfdecoder* hfdecoder_new(const uint8_t *lengths, size_t n);
+// function that creates a decoder with a primary table of exactly table_bits bits
+struct hfdecoder* hfdecoder_new_with_width(const uint8_t *lengths, size_t n, uint8_t table_bits);
+// function that frees a decoder
+void hfdecoder_destroy(struct hfdecoder *p);
+// function that decodes n byte symbols starting at bit_offset in buf into out;
+// returns the bit offset right after the last decoded symbol
+uint64_t hfdecoder_decode(struct hfdecoder *p, const uint8_t *buf,
+                          uint64_t bit_offset, uint8_t *out, size_t n);
+// function that decodes n 16-bit symbols starting at bit_offset in buf into out
+uint64_t hfdecoder_decode16(struct hfdecoder *p, const uint8_t *buf,
+                            uint64_t bit_offset, uint16_t *out, size_t n);
+
+// function that decodes a single symbol at *bit_offset and moves the offset past it
+static inline uint16_t hfdecoder_next(const struct hfdecoder *p, const uint8_t *buf, uint64_t *bit_offset) {
+    uint32_t window = bitstream_peek(buf, *bit_offset);
+    uint32_t entry = p->table[window >> (32 - p->table_bits)];
+
+    // rare long code: one more lookup with the bits after the prefix
+    if (entry & HFDECODER_LINK) {
+        uint8_t sub_bits = (entry >> 24) & 0x1F;
+        entry = p->table[(entry & 0xFFFFFF) + ((window << p->table_bits) >> (32 - sub_bits))];
+    }
+
+    *bit_offset += (entry >> 16) & 0xFF;
+    return (uint16_t) entry;
+}
+
 #endif
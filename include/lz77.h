@@ -0,0 +1,37 @@
+#ifndef LZ77_H
+#define LZ77_H
+
+#include "bitstream.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ77_WINDOW (32 * 1024)     // farthest a match may reach back
+#define LZ77_MIN_MATCH 3
+#define LZ77_MAX_MATCH 258
+#define LZ77_MAX_CHAIN 64           // candidates visited per position
+#define LZ77_LAZY_LIMIT 32          // matches at least this long are taken without a lazy look-ahead
+#define LZ77_HASH_BITS 15
+#define LZ77_CHECKSUM_CHUNK 4096    // decoded bytes checksummed at a time
+
+// DEFLATE alphabets: literals 0-255, (unused) end of block 256, lengths 257-285;
+// distances 0-29; both carry extra bits after the code
+#define LZ77_LITLEN_SYMBOLS 286
+#define LZ77_DIST_SYMBOLS 30
+#define LZ77_MAX_BITS 15
+
+// function that encodes a block with LZ77 followed by Huffman coding of the
+// literal/length and distance streams; the block starts with the code lengths
+// of both alphabets (one byte each) and matches never reach before the block,
+// so it can be decoded on its own
+struct bitstream* lz77_encode_block(const uint8_t *in, size_t length);
+// function that decodes the first n bytes of a block of size bytes produced by
+// lz77_encode_block; buf must be followed by BITSTREAM_PADDING readable bytes.
+// If checksum is not NULL, it is extended (CRC32C) with the decoded bytes every
+// LZ77_CHECKSUM_CHUNK bytes, while they are still in L1.
+// Returns 0 on success and -1 if the block is corrupted (invalid code lengths,
+// invalid symbols, a match reaching before the block or a stream running past
+// its end)
+int lz77_decode_block(const uint8_t *buf, size_t size, uint8_t *out, size_t n, uint32_t *checksum);
+
+#endif
@@ -2,27 +2,42 @@
 #define PARALLEL_COMPRESSION_H
 
 #include "huffman.h"
+#include "container.h"
 
 #include <stdio.h>
 
-struct bitstream {
-    uint8_t *buf;
-    size_t capacity;    // buffer size in bytes
-
-    uint64_t length;    // in bits
-    uint64_t offset;    // current offset (in bits) into the stream
+// struct for the statistics of a compression run
+struct parallel_compressor_stats {
+    double sample_rate;         // fraction of the input read to build the histogram
+    uint64_t sampled;           // number of symbols counted
+    double estimated_bits;      // estimated bits per symbol under the (smoothed) sampled histogram
+    double actual_bits;         // encoded bits per symbol of the Huffman coded intervals
+    double loss_bound;          // bound on the fraction of those bits that a code built from the
+                                // exact histogram could save (99% confidence, counting sample
+                                // windows rather than bytes as independent draws); 0 if not sampled
+    uint64_t modes[4];          // number of checkpoint intervals stored in each enum block_mode
 };
 
 struct parallel_compressor {
-    struct hfcode *dict;
-
     uint8_t *in;
     size_t in_size;
 
-    struct bitstream *ostream;
+    // threads used by every parallel loop; 1 skips the parallel regions entirely
+    int threads;
+
+    // uncompressed bytes between two checkpoints; the output can be
+    // decoded starting from any checkpoint
+    uint32_t checkpoint_interval;
+
+    // fraction of the input read to build the histogram; 1.0 reads everything
+    double sample_rate;
+
+    struct container *container;    // seekable output (code table, checkpoints and payload)
+    struct parallel_compressor_stats stats;
 };
 
-struct parallel_compressor* parallel_compressor_new(uint8_t *input, size_t len);
+struct parallel_compressor* parallel_compressor_new(uint8_t *input, size_t len, int threads,
+                                                    uint32_t checkpoint_interval, double sample_rate, int lz77);
 void parallel_compressor_destroy(struct parallel_compressor *p);
 void parallel_compressor_digest(struct parallel_compressor *p);
 
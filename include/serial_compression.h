@@ -2,18 +2,10 @@
 #define SERIAL_COMPRESSION_H
 
 #include "huffman.h"
+#include "bitstream.h"
 
 #include <stdio.h>
 
-// struct for the bitstream that will hold the final Huffman code
-struct bitstream {
-    uint8_t *buf;
-    size_t capacity;    // buffer size in bytes
-
-    uint64_t length;    // in bits
-    uint64_t offset;    // current offset (in bits) into the stream
-};
-
 // struct for the serial compressor
 struct serial_compressor {
     struct hfcode *dict;        // pointer to the dict that represents the code table
@@ -0,0 +1,52 @@
+#ifndef WIDE_COMPRESSION_H
+#define WIDE_COMPRESSION_H
+
+#include "huffman.h"
+#include "bitstream.h"
+
+#include <stdio.h>
+
+#define WIDE_MAGIC "HFW2"
+#define WIDE_SYMBOLS 65536
+#define WIDE_DEFAULT_BLOCK_SIZE (128 * 1024)    // in symbols
+#define WIDE_CHECKSUM_CHUNK 2048                // symbols checksummed at a time
+
+// struct for the compressor over 16-bit symbols (little endian pairs of input bytes);
+// the output is a block-indexed stream like the byte container, with a 65536-symbol
+// code table built by sorting instead of through the 256-slot heap
+struct wide_compressor {
+    uint16_t *in;                   // input symbols
+    size_t in_size;                 // number of input symbols
+    uint8_t tail;                   // last byte of an odd-sized input
+    uint8_t has_tail;               // whether the input had an odd size
+
+    uint32_t block_size;            // symbols per block
+    uint64_t block_count;           // number of blocks
+
+    uint64_t *frequencies;          // histogram over the whole alphabet
+    struct hfcode *dict;            // canonical code table (WIDE_SYMBOLS entries)
+
+    struct bitstream **blocks;      // per-block encoded streams
+    uint64_t *offsets;              // byte offset of each block in the payload (block_count + 1 entries)
+    uint32_t *checksums;            // CRC32C of each block's input bytes (the last one includes the tail)
+    uint8_t *payload;               // concatenated blocks
+};
+
+// function that creates a new wide compressor over a byte buffer of len bytes
+struct wide_compressor* wide_compressor_new(uint8_t *input, size_t len, uint32_t block_size);
+// function that frees a wide compressor
+void wide_compressor_destroy(struct wide_compressor *p);
+// function that digests the given input to produce the Huffman code
+void wide_compressor_digest(struct wide_compressor *p);
+// function that serializes the compressed stream
+void wide_compressor_write(struct wide_compressor *p, FILE *file);
+
+// function that decodes a stream written by wide_compressor_write into a new
+// buffer and verifies every block; returns NULL on failure and sets *len to the
+// decoded size in bytes; *failed is the number of corrupted blocks, or -1 if the
+// stream could not be read at all, and when it is positive *corrupted is set to
+// a new array of *blocks entries (freed by the caller) flagging each of them
+uint8_t* wide_decompress(FILE *file, size_t *len, int64_t *failed,
+                         uint8_t **corrupted, uint64_t *blocks);
+
+#endif
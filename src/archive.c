@@ -0,0 +1,301 @@
+#include "archive.h"
+#include "container.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+uint8_t* archive_read_file(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t filesize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // one extra byte so that empty files still get a valid buffer
+    uint8_t *buf = malloc(filesize + 1);
+    if (!buf) {
+        fprintf(stderr, "unable to allocate memory for reading the file\n");
+        fclose(file);
+        return NULL;
+    }
+    *size = fread(buf, 1, filesize, file);
+    fclose(file);
+
+    return buf;
+}
+
+int archive_create(const char *path, char **filenames, size_t count, uint32_t block_size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // the index offset is only known at the end, so we patch it afterwards
+    uint64_t member_count = count;
+    uint64_t index_offset = 0;
+    fwrite(ARCHIVE_MAGIC, 1, 4, file);
+    fwrite(&member_count, sizeof(member_count), 1, file);
+    fwrite(&index_offset, sizeof(index_offset), 1, file);
+
+    struct archive_entry *entries = calloc(count, sizeof(*entries));
+    int failed = 0;
+
+    // one task per file; container_compress then spawns one task per block,
+    // so a small file never holds more threads than it has blocks and the
+    // idle ones move on to the next file
+    #pragma omp parallel shared(entries, failed, file)
+    #pragma omp single
+    {
+        for (size_t i = 0; i < count; i++) {
+            #pragma omp task firstprivate(i)
+            {
+                size_t size = 0;
+                uint8_t *buf = archive_read_file(filenames[i], &size);
+
+                if (!buf) {
+                    #pragma omp atomic write
+                    failed = 1;
+                } else {
+                    struct container *c = container_new(size, block_size);
+                    container_compress(c, buf);
+                    free(buf);
+
+                    // members are written in completion order; the index
+                    // keeps track of where each of them ended up
+                    #pragma omp critical(archive_write)
+                    {
+                        entries[i].offset = ftell(file);
+                        container_write(c, file);
+                        entries[i].length = ftell(file) - entries[i].offset;
+                    }
+
+                    entries[i].name = filenames[i];
+                    entries[i].size = size;
+                    container_destroy(c);
+                }
+            }
+        }
+    }
+
+    if (failed) {
+        free(entries);
+        fclose(file);
+        remove(path);
+        return -1;
+    }
+
+    index_offset = ftell(file);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t name_length = strlen(entries[i].name);
+        fwrite(&name_length, sizeof(name_length), 1, file);
+        fwrite(entries[i].name, 1, name_length, file);
+        fwrite(&entries[i].size, sizeof(uint64_t), 1, file);
+        fwrite(&entries[i].offset, sizeof(uint64_t), 1, file);
+        fwrite(&entries[i].length, sizeof(uint64_t), 1, file);
+    }
+
+    fseek(file, 4 + sizeof(member_count), SEEK_SET);
+    fwrite(&index_offset, sizeof(index_offset), 1, file);
+
+    free(entries);
+    fclose(file);
+    return 0;
+}
+
+struct archive* archive_open(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char magic[4];
+    uint64_t count, index_offset;
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, ARCHIVE_MAGIC, 4) != 0 ||
+        fread(&count, sizeof(count), 1, file) != 1 ||
+        fread(&index_offset, sizeof(index_offset), 1, file) != 1) {
+        fprintf(stderr, "%s is not an archive\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    // every index entry takes at least a name length and three 64-bit fields,
+    // which bounds the member count by what is left of the file
+    const uint64_t min_entry_size = sizeof(uint32_t) + 3 * sizeof(uint64_t);
+    long file_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (file_size < 0 || index_offset > (uint64_t) file_size ||
+        count > ((uint64_t) file_size - index_offset) / min_entry_size ||
+        fseek(file, index_offset, SEEK_SET) != 0) {
+        fprintf(stderr, "corrupted index in %s\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    struct archive *p = calloc(1, sizeof(*p));
+    p->file = file;
+    p->entries = calloc(count ? count : 1, sizeof(struct archive_entry));
+    if (!p->entries) {
+        fprintf(stderr, "unable to allocate memory for the index of %s\n", path);
+        archive_close(p);
+        return NULL;
+    }
+    p->count = count;
+
+    for (uint64_t i = 0; i < count; i++) {
+        struct archive_entry *e = &p->entries[i];
+        uint32_t name_length;
+
+        if (fread(&name_length, sizeof(name_length), 1, file) != 1 || name_length > (uint64_t) file_size) {
+            fprintf(stderr, "truncated index in %s\n", path);
+            archive_close(p);
+            return NULL;
+        }
+
+        e->name = calloc(name_length + 1, 1);
+        if (fread(e->name, 1, name_length, file) != name_length ||
+            fread(&e->size, sizeof(uint64_t), 1, file) != 1 ||
+            fread(&e->offset, sizeof(uint64_t), 1, file) != 1 ||
+            fread(&e->length, sizeof(uint64_t), 1, file) != 1) {
+            fprintf(stderr, "truncated index in %s\n", path);
+            archive_close(p);
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+void archive_close(struct archive *p) {
+    for (uint64_t i = 0; i < p->count; i++) {
+        free(p->entries[i].name);
+    }
+    free(p->entries);
+    fclose(p->file);
+    free(p);
+}
+
+int64_t archive_find(struct archive *p, const char *name) {
+    for (uint64_t i = 0; i < p->count; i++) {
+        if (strcmp(p->entries[i].name, name) == 0) {
+            return (int64_t) i;
+        }
+    }
+    return -1;
+}
+
+int archive_extract(struct archive *p, uint64_t idx, FILE *file) {
+    struct archive_entry *e = &p->entries[idx];
+
+    // only this member's container is read and decoded
+    fseek(p->file, e->offset, SEEK_SET);
+    struct container *c = container_read(p->file);
+    if (!c) {
+        fprintf(stderr, "corrupted member %s\n", e->name);
+        return -1;
+    }
+
+    uint8_t *out = malloc(c->size + 1);
+    uint8_t *corrupted = malloc(c->block_count + 1);
+    int64_t failed = container_decode(c, out, corrupted);
+    for (uint64_t b = 0; failed > 0 && b < c->block_count; b++) {
+        if (corrupted[b]) {
+            fprintf(stderr, "corrupted member %s: block %lu failed its checksum\n", e->name, b);
+        }
+    }
+    free(corrupted);
+    if (failed > 0) {
+        free(out);
+        container_destroy(c);
+        return -1;
+    }
+    fwrite(out, 1, c->size, file);
+
+    free(out);
+    container_destroy(c);
+    return 0;
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./archive c <archive> <file>...\n");
+    fprintf(stderr, "       ./archive x <archive> <member> [output]\n");
+    fprintf(stderr, "       ./archive l <archive>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || strlen(argv[1]) != 1) {
+        usage();
+    }
+
+    switch (argv[1][0]) {
+    case 'c': {
+        if (argc < 4) {
+            usage();
+        }
+
+        double start = omp_get_wtime();
+        if (archive_create(argv[2], &argv[3], argc - 3, CONTAINER_DEFAULT_BLOCK_SIZE) != 0) {
+            exit(1);
+        }
+        double duration = omp_get_wtime() - start;
+        printf("%.6f\n", duration);
+        break;
+    }
+    case 'x': {
+        if (argc < 4 || argc > 5) {
+            usage();
+        }
+
+        struct archive *p = archive_open(argv[2]);
+        if (!p) {
+            exit(1);
+        }
+
+        int64_t idx = archive_find(p, argv[3]);
+        if (idx < 0) {
+            fprintf(stderr, "no member named %s in %s\n", argv[3], argv[2]);
+            exit(1);
+        }
+
+        FILE *file = argc == 5 ? fopen(argv[4], "wb") : stdout;
+        if (!file) {
+            fprintf(stderr, "failed to open file %s: %s\n", argv[4], strerror(errno));
+            exit(1);
+        }
+
+        if (archive_extract(p, idx, file) != 0) {
+            exit(1);
+        }
+
+        if (file != stdout) {
+            fclose(file);
+        }
+        archive_close(p);
+        break;
+    }
+    case 'l': {
+        struct archive *p = archive_open(argv[2]);
+        if (!p) {
+            exit(1);
+        }
+
+        for (uint64_t i = 0; i < p->count; i++) {
+            struct archive_entry *e = &p->entries[i];
+            printf("%12lu %12lu %s\n", e->size, e->length, e->name);
+        }
+        archive_close(p);
+        break;
+    }
+    default:
+        usage();
+    }
+}
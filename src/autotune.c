@@ -0,0 +1,195 @@
+#include "autotune.h"
+#include "container.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <omp.h>
+
+// builds the path of the cache file into path; returns 0 if there is no
+// suitable directory (the model is then calibrated on every run)
+int autotune_cache_path(char *path, size_t size, int create) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[4096];
+
+    if (xdg && *xdg) {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return 0;
+    }
+
+    if (create) {
+        mkdir(dir, 0755);
+        size_t len = strlen(dir);
+        snprintf(dir + len, sizeof(dir) - len, "/%s", AUTOTUNE_CACHE_DIR);
+        mkdir(dir, 0755);
+    } else {
+        size_t len = strlen(dir);
+        snprintf(dir + len, sizeof(dir) - len, "/%s", AUTOTUNE_CACHE_DIR);
+    }
+
+    snprintf(path, size, "%s/%s", dir, AUTOTUNE_CACHE_FILE);
+    return 1;
+}
+
+void autotune_calibrate(struct autotune *p) {
+    p->max_threads = omp_get_max_threads();
+
+    // cold start: the first parallel region of the process creates the pool
+    double start = omp_get_wtime();
+    #pragma omp parallel num_threads(p->max_threads)
+    {
+        // nothing to do, we only time the spin-up
+    }
+    p->spawn_cost = (omp_get_wtime() - start) / p->max_threads;
+
+    // warm fork/join of an already existing pool
+    const int forks = 100;
+    start = omp_get_wtime();
+    for (int i = 0; i < forks; i++) {
+        #pragma omp parallel num_threads(p->max_threads)
+        {
+            // again, only the fork/join itself
+        }
+    }
+    p->fork_cost = (omp_get_wtime() - start) / forks / p->max_threads;
+
+    // single-threaded histogram + encode over text-like data (a skewed
+    // distribution of printable bytes from a fixed LCG)
+    uint8_t *buf = malloc(AUTOTUNE_BENCH_SIZE);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < AUTOTUNE_BENCH_SIZE; i++) {
+        state = state * 1103515245u + 12345u;
+        uint32_t r = (state >> 16) & 0x7FFF;
+        buf[i] = (uint8_t) (32 + (r * r >> 24));
+    }
+
+    double best = 0;
+    for (int r = 0; r < 3; r++) {
+        struct container *c = container_new(AUTOTUNE_BENCH_SIZE, AUTOTUNE_BENCH_SIZE);
+        start = omp_get_wtime();
+        container_count_block(c, buf, 0);
+        container_build_code(c);
+        container_encode_block(c, buf, 0);
+        double duration = omp_get_wtime() - start;
+        container_destroy(c);
+
+        if (best == 0 || duration < best) {
+            best = duration;
+        }
+    }
+    p->byte_cost = best / AUTOTUNE_BENCH_SIZE;
+
+    free(buf);
+}
+
+struct autotune* autotune_load() {
+    struct autotune *p = calloc(1, sizeof(*p));
+    char path[4096];
+
+    if (autotune_cache_path(path, sizeof(path), 0)) {
+        FILE *file = fopen(path, "r");
+        if (file) {
+            int ok = fscanf(file, "threads %d\nbyte_cost %lf\nspawn_cost %lf\nfork_cost %lf\n",
+                            &p->max_threads, &p->byte_cost, &p->spawn_cost, &p->fork_cost) == 4;
+            fclose(file);
+
+            // a cache calibrated for another thread count is stale
+            if (ok && p->max_threads == omp_get_max_threads()) {
+                return p;
+            }
+        }
+    }
+
+    autotune_calibrate(p);
+
+    if (autotune_cache_path(path, sizeof(path), 1)) {
+        FILE *file = fopen(path, "w");
+        if (file) {
+            fprintf(file, "threads %d\nbyte_cost %.12e\nspawn_cost %.12e\nfork_cost %.12e\n",
+                    p->max_threads, p->byte_cost, p->spawn_cost, p->fork_cost);
+            fclose(file);
+        } else {
+            fprintf(stderr, "failed to write autotune cache %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    return p;
+}
+
+void autotune_destroy(struct autotune *p) {
+    free(p);
+}
+
+double autotune_cost(struct autotune *p, size_t size, int threads, uint32_t block_size) {
+    // a thread without a block of its own only adds overhead
+    uint64_t blocks = (size + block_size - 1) / block_size;
+    int busy = (uint64_t) threads < blocks ? threads : (int) blocks;
+    if (busy < 1) {
+        busy = 1;
+    }
+
+    double cost = size * p->byte_cost / busy;
+    if (threads > 1) {
+        cost += threads * (p->spawn_cost + AUTOTUNE_REGIONS * p->fork_cost);
+    }
+    return cost;
+}
+
+uint32_t autotune_block_size(size_t size, int threads) {
+    if (threads == 1) {
+        return CONTAINER_DEFAULT_BLOCK_SIZE;
+    }
+
+    // a few blocks per thread for load balancing, but not so small that
+    // the per-block setup dominates
+    uint64_t target = size / ((uint64_t) threads * AUTOTUNE_BLOCKS_PER_THREAD);
+    uint32_t block_size = AUTOTUNE_MIN_BLOCK_SIZE;
+    while (block_size < CONTAINER_DEFAULT_BLOCK_SIZE && block_size * 2 <= target) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+struct autotune_plan autotune_plan(struct autotune *p, size_t size) {
+    struct autotune_plan plan;
+    plan.threads = 1;
+    plan.block_size = autotune_block_size(size, 1);
+    plan.estimated = autotune_cost(p, size, 1, plan.block_size);
+
+    for (int t = 2; t <= p->max_threads; t++) {
+        uint32_t block_size = autotune_block_size(size, t);
+        double cost = autotune_cost(p, size, t, block_size);
+        if (cost < plan.estimated) {
+            plan.threads = t;
+            plan.block_size = block_size;
+            plan.estimated = cost;
+        }
+    }
+
+    return plan;
+}
+
+size_t autotune_serial_cutoff(struct autotune *p) {
+    if (p->max_threads == 1) {
+        return SIZE_MAX;
+    }
+
+    // the cost is monotonic enough in the size for a binary search
+    size_t lo = 1, hi = (size_t) 1 << 40;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (autotune_plan(p, mid).threads > 1) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
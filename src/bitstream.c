@@ -0,0 +1,139 @@
+#include "bitstream.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+struct bitstream* bitstream_new(size_t capacity) {
+    struct bitstream *p = malloc(sizeof(struct bitstream));
+    p->buf = calloc(capacity + BITSTREAM_PADDING, 1);
+    p->capacity = capacity;
+    p->length = 0;
+    p->offset = 0;
+
+    return p;
+}
+
+void bitstream_destroy(struct bitstream *p) {
+    free(p->buf);
+    free(p);
+}
+
+size_t bitstream_size(struct bitstream *p) {
+    return (p->offset % 8 == 0) ? p->offset / 8 : p->offset / 8 + 1;
+}
+
+void bitstream_print(struct bitstream *p) {
+    printf("offset=%lu\n", p->offset);
+    printf("[ ");
+    size_t size = bitstream_size(p);
+    for (uint64_t i = 0; i < size; i++) {
+        printf("%08b ", p->buf[i]);
+    }
+    printf("]\n");
+}
+
+// up to 32 bit chunks
+// TODO: should probably inline this
+void bitstream_push_chunk(struct bitstream *p, uint32_t chunk, uint8_t bit_length) {
+    // how many bits between the stream's current offset and the next byte boundary
+    uint64_t byte_offset = p->offset / 8;
+    uint8_t offset_within_byte = p->offset % 8;
+    uint8_t last_byte = p->buf[byte_offset];
+
+    /**
+     *
+     *      offset_within_byte
+     *        |----------|                               chunk we'd like to push
+     *         1   1   0   _   _   _   _   _          1   1   1   0   1   1   1   _
+     *        |-----------------------------|        |-----------------------------|
+     *                  8 bits
+     *
+     *        how to merge these (considering the push might cross the byte boundary)?
+     *        we expand both to 40 bits, right shift our chunk by offset_within_bytes bits,
+     *        OR both parts together and then convert back to five 8-bit chunks
+     *        (a chunk has at most 32 bits, so 7 + 32 bits always fit in the window):
+     *
+     *                   original byte chunk expanded to 40 bits
+     *       |-------------------------------------------------------------|
+     *        1   1   0   _   _   _   _   _ | _   _   _   _   _   _   _   _ | ...
+     *        0   0   0   1   1   1   0   1 | 1   1   _   _   _   _   _   _ | ...
+     *                   |-------------------------|
+     *                  out chunk expanded to 40 bits
+     *           and shifted offset_within_byte = 3 units to the right
+     *
+     */
+
+    uint64_t expanded_original_byte = (uint64_t) last_byte << 32;
+    uint64_t expanded_and_shifted_chunk = ((uint64_t) chunk << (40 - bit_length)) >> offset_within_byte;
+    uint64_t result = expanded_original_byte | expanded_and_shifted_chunk;
+
+    // we now push the resulting bytes to the end of our buffer (the bytes past
+    // the offset are still zero, so overwriting them is harmless)
+    p->buf[byte_offset] = (uint8_t) (result >> 32);
+    p->buf[byte_offset + 1] = (uint8_t) (result >> 24);
+    p->buf[byte_offset + 2] = (uint8_t) (result >> 16);
+    p->buf[byte_offset + 3] = (uint8_t) (result >> 8);
+    p->buf[byte_offset + 4] = (uint8_t) (result & 0xFF);
+    p->offset += bit_length;
+    // printf("bitstream currently at offset=%lu (grew %u bits)\n", p->offset, bit_length);
+}
+
+void test_bitstream_push_chunk() {
+    struct bitstream *p = bitstream_new(16);
+    bitstream_push_chunk(p, 0b1101, 4);
+    assert(p->buf[0] == 0b11010000);
+    assert(p->offset == 4);
+    bitstream_push_chunk(p, 0b111111, 6);
+    assert(p->buf[0] == 0b11011111 && p->buf[1] == 0b11000000);
+    assert(p->offset == 10);
+    bitstream_push_chunk(p, 0x3FFFF, 18);
+    assert(p->buf[1] == 0b11111111 && p->buf[2] == 0b11111111 && p->buf[3] == 0b11110000);
+    assert(p->offset == 28);
+    assert(bitstream_peek(p->buf, 4) == 0xFFFFFF00);
+    bitstream_destroy(p);
+}
+
+void bitstream_append(struct bitstream *p, struct bitstream *q) {
+    size_t idx = p->offset / 8;
+    size_t q_size = bitstream_size(q);
+    uint8_t shift = p->offset  % 8;
+
+    if (q_size == 0) {
+        return;
+    }
+
+    // byte aligned, nothing to shift
+    if (shift == 0) {
+        memcpy(p->buf + idx, q->buf, q_size);
+        p->offset += q->offset;
+        return;
+    }
+
+    p->buf[idx] |= q->buf[0] >> shift;
+    idx++;
+
+    for (size_t i = 0; i < q_size - 1; i++) {
+        p->buf[idx + i] = q->buf[i] << (8 - shift) | q->buf[i+1] >> shift;
+    }
+
+    p->buf[idx + q_size - 1] = q->buf[q_size - 1] << (8 - shift);
+    p->offset += q->offset;
+}
+
+void test_bitstream_append() {
+    struct bitstream *a = bitstream_new(16);
+    struct bitstream *b = bitstream_new(16);
+    bitstream_push_chunk(a, 0b11110111, 8);
+    bitstream_push_chunk(a, 0b000, 3);
+    bitstream_push_chunk(b, 0b11111, 5);
+    bitstream_push_chunk(b, 0b11111111, 8);
+    bitstream_append(a, b);
+    assert(a->buf[0] == 0b11110111);
+    assert(a->buf[1] == 0b00011111);
+    assert(a->buf[2] == 0b11111111);
+    bitstream_print(a);
+    bitstream_destroy(a);
+    bitstream_destroy(b);
+}
@@ -0,0 +1,604 @@
+#include "container.h"
+#include "huffman.h"
+#include "bitstream.h"
+#include "lz77.h"
+#include "crc32c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <omp.h>
+
+// allocates a container with only the arrays needed for decoding (modes,
+// offsets and checksums); returns NULL if any allocation fails
+static struct container* container_alloc(uint64_t size, uint32_t block_size) {
+    struct container *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->size = size;
+    p->block_size = block_size;
+    // written so that it cannot wrap around for sizes close to 2^64
+    p->block_count = size / block_size + (size % block_size != 0);
+    p->threads = omp_get_max_threads();
+
+    p->modes = calloc(p->block_count + 1, sizeof(uint8_t));
+    p->offsets = calloc(p->block_count + 1, sizeof(uint64_t));
+    p->checksums = calloc(p->block_count + 1, sizeof(uint32_t));
+    if (!p->modes || !p->offsets || !p->checksums) {
+        container_destroy(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+struct container* container_new(uint64_t size, uint32_t block_size) {
+    struct container *p = container_alloc(size, block_size);
+    p->histograms = calloc(p->block_count * 256, sizeof(uint64_t));
+    p->runs = calloc(p->block_count, sizeof(uint64_t));
+    p->blocks = calloc(p->block_count, sizeof(struct bitstream *));
+    return p;
+}
+
+void container_destroy(struct container *p) {
+    if (p->blocks) {
+        for (uint64_t i = 0; i < p->block_count; i++) {
+            if (p->blocks[i]) {
+                bitstream_destroy(p->blocks[i]);
+            }
+        }
+    }
+
+    if (p->decoder) {
+        hfdecoder_destroy(p->decoder);
+    }
+
+    free(p->blocks);
+    free(p->histograms);
+    free(p->runs);
+    free(p->modes);
+    free(p->offsets);
+    free(p->checksums);
+    free(p->payload);
+    free(p);
+}
+
+uint64_t container_block_length(struct container *p, uint64_t block) {
+    uint64_t start = block * p->block_size;
+    return p->size - start < p->block_size ? p->size - start : p->block_size;
+}
+
+void container_count_block(struct container *p, const uint8_t *in, uint64_t block) {
+    uint64_t *frequencies = &p->histograms[block * 256];
+    const uint8_t *start = in + block * p->block_size;
+    uint64_t length = container_block_length(p, block);
+
+    // the checksum is computed here, one chunk at a time, since this pass
+    // reads every byte anyway; the encoding pass then does not need to
+    uint64_t runs = 0;
+    uint32_t checksum = 0;
+    for (uint64_t c = 0; c < length; c += CONTAINER_CHECKSUM_CHUNK) {
+        uint64_t end = c + CONTAINER_CHECKSUM_CHUNK < length ? c + CONTAINER_CHECKSUM_CHUNK : length;
+        checksum = crc32c_update(checksum, start + c, end - c);
+        for (uint64_t i = c; i < end; i++) {
+            frequencies[start[i]]++;
+            runs += (i == 0 || start[i] != start[i - 1]);
+        }
+    }
+    p->runs[block] = runs;
+    p->checksums[block] = checksum;
+}
+
+void container_sample_block(struct container *p, const uint8_t *in, uint64_t block, uint64_t stride) {
+    uint64_t *frequencies = &p->histograms[block * 256];
+    const uint8_t *start = in + block * p->block_size;
+    uint64_t length = container_block_length(p, block);
+
+    // a single window would cover the whole block anyway
+    if (length <= CONTAINER_SAMPLE_WINDOW || stride <= CONTAINER_SAMPLE_WINDOW) {
+        container_count_block(p, in, block);
+        return;
+    }
+
+    // one window per stride-sized stratum, at a random offset that wraps around
+    // within the stratum: every byte is equally likely to be read and the windows
+    // are drawn independently; the generator is seeded with the block index so
+    // that runs are reproducible. The last stratum may be shorter, so its window
+    // shrinks with it, or the block tail would be read more often than the rest
+    uint64_t state = (block + 1) * 0x9e3779b97f4a7c15ull;
+    for (uint64_t s = 0; s < length; s += stride) {
+        const uint8_t *stratum = start + s;
+        uint64_t size = s + stride < length ? stride : length - s;
+        uint64_t window = CONTAINER_SAMPLE_WINDOW * size / stride;
+        if (window == 0) {
+            break;
+        }
+
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        uint64_t offset = (state >> 33) % size;
+        uint64_t head = offset + window < size ? window : size - offset;
+        for (uint64_t i = 0; i < head; i++) {
+            frequencies[stratum[offset + i]]++;
+        }
+        for (uint64_t i = 0; i < window - head; i++) {
+            frequencies[stratum[i]]++;
+        }
+    }
+}
+
+void container_build_code(struct container *p) {
+    uint64_t frequencies[256] = {0};
+    uint64_t counted = 0;
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        for (size_t i = 0; i < 256; i++) {
+            frequencies[i] += p->histograms[b * 256 + i];
+            counted += p->histograms[b * 256 + i];
+        }
+    }
+
+    // a sampled histogram may have missed symbols that do occur in the input,
+    // so every symbol needs a code
+    if (counted != p->size) {
+        for (size_t i = 0; i < 256; i++) {
+            frequencies[i] += 1;
+        }
+    }
+
+    struct hftree *tree = hftree_new(frequencies);
+    memset(p->dict, 0, sizeof(p->dict));
+    hftree_generate_dict(tree, p->dict);
+    hftree_destroy(tree);
+
+    uint8_t lengths[256];
+    for (size_t i = 0; i < 256; i++) {
+        lengths[i] = p->dict[i].bit_length;
+    }
+    p->decoder = hfdecoder_new(lengths, 256);
+}
+
+void container_encode_block(struct container *p, const uint8_t *in, uint64_t block) {
+    const uint8_t *start = in + block * p->block_size;
+    uint64_t length = container_block_length(p, block);
+
+    // an exact histogram gives us the exact encoded size up front;
+    // a sampled one only bounds it by the longest code
+    uint64_t bits = 0, counted = 0;
+    uint8_t longest = 0;
+    for (size_t i = 0; i < 256; i++) {
+        bits += p->histograms[block * 256 + i] * p->dict[i].bit_length;
+        counted += p->histograms[block * 256 + i];
+        if (p->dict[i].bit_length > longest) {
+            longest = p->dict[i].bit_length;
+        }
+    }
+
+    uint64_t huffman_size = (bits + 7) / 8;
+    uint64_t raw_threshold = length - length / CONTAINER_MIN_GAIN;
+    uint64_t rle_size = p->runs[block] * CONTAINER_RLE_RUN_SIZE;
+
+    enum block_mode mode = BLOCK_HUFFMAN;
+    if (counted != length) {
+        // sampled: we only find out after encoding whether Huffman paid off
+        huffman_size = (length * longest + 7) / 8;
+    } else if (rle_size < huffman_size && rle_size < length) {
+        mode = BLOCK_RLE;
+    } else if (raw_threshold <= huffman_size) {
+        mode = BLOCK_RAW;
+    }
+
+    // the size of an LZ77 block is only known after running the matcher,
+    // so it competes against the best of the other modes
+    if (p->lz77) {
+        struct bitstream *lz = lz77_encode_block(start, length);
+        // a sampled huffman_size is only an upper bound, so LZ77 always has to
+        // clear the raw threshold as well
+        uint64_t best = mode == BLOCK_RLE ? rle_size : huffman_size;
+        if (best > raw_threshold) {
+            best = raw_threshold;
+        }
+        if (bitstream_size(lz) < best) {
+            // a sampled block was not checksummed by the counting pass; next
+            // to the matcher's many passes over the block, one more is noise
+            if (counted != length) {
+                p->checksums[block] = crc32c_update(0, start, length);
+            }
+            p->modes[block] = BLOCK_LZ77;
+            p->blocks[block] = lz;
+            return;
+        }
+        bitstream_destroy(lz);
+    }
+
+    struct bitstream *ostream;
+    if (mode == BLOCK_HUFFMAN) {
+        // a sampled block was not checksummed by the counting pass, so each
+        // chunk is checksummed right before it is encoded instead
+        uint32_t checksum = 0;
+        ostream = bitstream_new(huffman_size + 1);
+        for (uint64_t c = 0; c < length; c += CONTAINER_CHECKSUM_CHUNK) {
+            uint64_t end = c + CONTAINER_CHECKSUM_CHUNK < length ? c + CONTAINER_CHECKSUM_CHUNK : length;
+            if (counted != length) {
+                checksum = crc32c_update(checksum, start + c, end - c);
+            }
+            for (uint64_t i = c; i < end; i++) {
+                struct hfcode t = p->dict[start[i]];
+                bitstream_push_chunk(ostream, t.code, t.bit_length);
+            }
+        }
+
+        if (counted != length) {
+            p->checksums[block] = checksum;
+            if (bitstream_size(ostream) >= raw_threshold) {
+                bitstream_destroy(ostream);
+                mode = BLOCK_RAW;
+            }
+        }
+    }
+
+    if (mode == BLOCK_RAW) {
+        ostream = bitstream_new(length);
+        memcpy(ostream->buf, start, length);
+        ostream->offset = length * 8;
+    } else if (mode == BLOCK_RLE) {
+        ostream = bitstream_new(rle_size);
+        uint8_t *out = ostream->buf;
+        for (uint64_t i = 0; i < length;) {
+            uint32_t run = 1;
+            while (i + run < length && start[i + run] == start[i]) {
+                run++;
+            }
+            out[0] = start[i];
+            memcpy(out + 1, &run, sizeof(run));
+            out += CONTAINER_RLE_RUN_SIZE;
+            i += run;
+        }
+        ostream->offset = rle_size * 8;
+    }
+
+    p->modes[block] = mode;
+    p->blocks[block] = ostream;
+}
+
+void container_finish(struct container *p) {
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        p->offsets[b + 1] = p->offsets[b] + bitstream_size(p->blocks[b]);
+    }
+
+    p->payload = calloc(p->offsets[p->block_count] + BITSTREAM_PADDING, 1);
+
+    #pragma omp parallel for schedule(static) num_threads(p->threads) if(omp_get_level() == 0 && p->threads > 1 && p->block_count > 1)
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        memcpy(p->payload + p->offsets[b], p->blocks[b]->buf, bitstream_size(p->blocks[b]));
+        bitstream_destroy(p->blocks[b]);
+        p->blocks[b] = NULL;
+    }
+
+    free(p->histograms);
+    free(p->runs);
+    p->histograms = NULL;
+    p->runs = NULL;
+}
+
+void container_compress(struct container *p, const uint8_t *in) {
+    // standalone call: spin up a thread pool and hand it the tasks
+    if (omp_get_level() == 0) {
+        #pragma omp parallel
+        #pragma omp single
+        container_compress(p, in);
+        return;
+    }
+
+    #pragma omp taskgroup
+    {
+        for (uint64_t b = 0; b < p->block_count; b++) {
+            #pragma omp task firstprivate(b)
+            container_count_block(p, in, b);
+        }
+    }
+
+    container_build_code(p);
+
+    #pragma omp taskgroup
+    {
+        for (uint64_t b = 0; b < p->block_count; b++) {
+            #pragma omp task firstprivate(b)
+            container_encode_block(p, in, b);
+        }
+    }
+
+    container_finish(p);
+}
+
+// decodes the first to bytes of a given block into out and extends checksum
+// with them one chunk at a time, while each chunk is still in L1; returns -1
+// if the block is visibly corrupted
+static int container_decode_head(struct container *p, uint64_t block, uint64_t to,
+                                 uint8_t *out, uint32_t *checksum) {
+    const uint8_t *buf = p->payload + p->offsets[block];
+    uint64_t size = p->offsets[block + 1] - p->offsets[block];
+
+    switch (p->modes[block]) {
+    case BLOCK_HUFFMAN: {
+        // a corrupted stream that runs past the end of its block is caught
+        // at the next chunk
+        uint64_t bit_offset = 0;
+        for (uint64_t c = 0; c < to; c += CONTAINER_CHECKSUM_CHUNK) {
+            if (bit_offset > size * 8) {
+                return -1;
+            }
+            uint64_t n = c + CONTAINER_CHECKSUM_CHUNK < to ? CONTAINER_CHECKSUM_CHUNK : to - c;
+            bit_offset = hfdecoder_decode(p->decoder, buf, bit_offset, out + c, n);
+            *checksum = crc32c_update(*checksum, out + c, n);
+        }
+        return 0;
+    }
+    case BLOCK_RAW:
+        // container_read makes sure raw blocks are exactly as long as their input
+        for (uint64_t c = 0; c < to; c += CONTAINER_CHECKSUM_CHUNK) {
+            uint64_t n = c + CONTAINER_CHECKSUM_CHUNK < to ? CONTAINER_CHECKSUM_CHUNK : to - c;
+            memcpy(out + c, buf + c, n);
+            *checksum = crc32c_update(*checksum, out + c, n);
+        }
+        return 0;
+    case BLOCK_RLE: {
+        // the walk stays within the block, and an empty run or too few
+        // runs mean corruption; long runs are written a chunk at a time
+        const uint8_t *end = buf + size;
+        for (uint64_t position = 0; position < to; buf += CONTAINER_RLE_RUN_SIZE) {
+            if (end - buf < CONTAINER_RLE_RUN_SIZE) {
+                return -1;
+            }
+            uint32_t run;
+            memcpy(&run, buf + 1, sizeof(run));
+            if (run == 0) {
+                return -1;
+            }
+
+            uint64_t run_end = position + run < to ? position + run : to;
+            while (position < run_end) {
+                uint64_t n = run_end - position < CONTAINER_CHECKSUM_CHUNK ? run_end - position
+                                                                            : CONTAINER_CHECKSUM_CHUNK;
+                memset(out + position, buf[0], n);
+                *checksum = crc32c_update(*checksum, out + position, n);
+                position += n;
+            }
+        }
+        return 0;
+    }
+    case BLOCK_LZ77:
+        return lz77_decode_block(buf, size, out, to, checksum);
+    default:
+        // container_read rejects unknown modes, so this is only a safety net
+        return -1;
+    }
+}
+
+int container_decode_block(struct container *p, uint64_t block, uint8_t *out) {
+    uint32_t checksum = 0;
+    if (container_decode_head(p, block, container_block_length(p, block), out, &checksum) != 0) {
+        return -1;
+    }
+    return checksum == p->checksums[block] ? 0 : -1;
+}
+
+int64_t container_decode(struct container *p, uint8_t *out, uint8_t *corrupted) {
+    int64_t failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        int status = container_decode_block(p, b, out + b * p->block_size);
+        if (corrupted) {
+            corrupted[b] = status != 0;
+        }
+        failed += status != 0;
+    }
+
+    return failed;
+}
+
+int64_t container_decompress_range(struct container *p, uint64_t off, uint64_t len,
+                                   uint8_t *out, uint8_t *corrupted) {
+    // written so that off + len cannot overflow
+    if (off > p->size || len > p->size - off) {
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    uint64_t first = off / p->block_size;
+    uint64_t last = (off + len - 1) / p->block_size;
+    int64_t failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) if(last > first) reduction(+:failed)
+    for (uint64_t b = first; b <= last; b++) {
+        uint64_t start = b * p->block_size;
+        uint64_t length = container_block_length(p, b);
+        int status;
+
+        if (start >= off && start + length <= off + len) {
+            status = container_decode_block(p, b, out + (start - off));
+        } else {
+            // a block cut by the range is still decoded whole, since the
+            // checksum covers all of it
+            uint8_t *tmp = malloc(length);
+            status = container_decode_block(p, b, tmp);
+
+            uint64_t from = start >= off ? 0 : off - start;
+            uint64_t to = start + length > off + len ? off + len - start : length;
+            memcpy(out + (start + from - off), tmp + from, to - from);
+            free(tmp);
+        }
+
+        if (corrupted) {
+            corrupted[b] = status != 0;
+        }
+        failed += status != 0;
+    }
+
+    return failed;
+}
+
+// checksum of everything before the payload, in file order
+static uint32_t container_index_checksum(struct container *p, const uint8_t *lengths) {
+    uint32_t crc = crc32c_update(0, (const uint8_t *) CONTAINER_MAGIC, 4);
+    crc = crc32c_update(crc, (const uint8_t *) &p->block_size, sizeof(p->block_size));
+    crc = crc32c_update(crc, (const uint8_t *) &p->size, sizeof(p->size));
+    crc = crc32c_update(crc, (const uint8_t *) &p->block_count, sizeof(p->block_count));
+    crc = crc32c_update(crc, lengths, 256);
+    crc = crc32c_update(crc, p->modes, p->block_count);
+    crc = crc32c_update(crc, (const uint8_t *) p->offsets, (p->block_count + 1) * sizeof(uint64_t));
+    return crc32c_update(crc, (const uint8_t *) p->checksums, p->block_count * sizeof(uint32_t));
+}
+
+void container_write(struct container *p, FILE *file) {
+    uint8_t lengths[256];
+    for (size_t i = 0; i < 256; i++) {
+        lengths[i] = p->dict[i].bit_length;
+    }
+
+    // every field is written in host byte order
+    fwrite(CONTAINER_MAGIC, 1, 4, file);
+    fwrite(&p->block_size, sizeof(p->block_size), 1, file);
+    fwrite(&p->size, sizeof(p->size), 1, file);
+    fwrite(&p->block_count, sizeof(p->block_count), 1, file);
+    fwrite(lengths, 1, 256, file);
+    fwrite(p->modes, 1, p->block_count, file);
+    fwrite(p->offsets, sizeof(uint64_t), p->block_count + 1, file);
+    fwrite(p->checksums, sizeof(uint32_t), p->block_count, file);
+
+    uint32_t index_checksum = container_index_checksum(p, lengths);
+    fwrite(&index_checksum, sizeof(index_checksum), 1, file);
+    fwrite(p->payload, 1, p->offsets[p->block_count], file);
+}
+
+struct container* container_read(FILE *file) {
+    char magic[4];
+    uint32_t block_size;
+    uint64_t size, block_count;
+    uint8_t lengths[256];
+
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, CONTAINER_MAGIC, 4) != 0) {
+        return NULL;
+    }
+    if (fread(&block_size, sizeof(block_size), 1, file) != 1 ||
+        fread(&size, sizeof(size), 1, file) != 1 ||
+        fread(&block_count, sizeof(block_count), 1, file) != 1 ||
+        fread(lengths, 1, 256, file) != 256) {
+        return NULL;
+    }
+
+    // the header is untrusted: the geometry has to be consistent, the lengths
+    // have to describe a prefix code, and the index (a mode, an offset and a
+    // checksum per block) has to fit in what is left of the file, all before
+    // anything is allocated
+    long position = ftell(file);
+    long file_size = position >= 0 && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (file_size < 0 || fseek(file, position, SEEK_SET) != 0) {
+        return NULL;
+    }
+    const uint64_t entry_size = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    uint64_t remaining = (uint64_t) (file_size - position);
+    if (block_size == 0 || block_count != size / block_size + (size % block_size != 0) ||
+        block_count > remaining / entry_size || !hflengths_valid(lengths, 256, HFCODE_MAX_BITS)) {
+        return NULL;
+    }
+
+    struct container *p = container_alloc(size, block_size);
+    if (!p) {
+        return NULL;
+    }
+
+    uint32_t index_checksum;
+    if (fread(p->modes, 1, block_count, file) != block_count ||
+        fread(p->offsets, sizeof(uint64_t), block_count + 1, file) != block_count + 1 ||
+        fread(p->checksums, sizeof(uint32_t), block_count, file) != block_count ||
+        fread(&index_checksum, sizeof(index_checksum), 1, file) != 1 ||
+        index_checksum != container_index_checksum(p, lengths)) {
+        container_destroy(p);
+        return NULL;
+    }
+
+    // the index checksum catches accidental damage; these checks keep a
+    // crafted index from sending decoding outside of the payload
+    for (uint64_t b = 0; b < block_count; b++) {
+        if (p->modes[b] > BLOCK_LZ77 || p->offsets[b + 1] < p->offsets[b] ||
+            (p->modes[b] == BLOCK_RAW && p->offsets[b + 1] - p->offsets[b] != container_block_length(p, b))) {
+            container_destroy(p);
+            return NULL;
+        }
+    }
+
+    // a corrupted Huffman block may overrun its end by up to one chunk of the
+    // longest codes before container_decode_block notices
+    uint64_t payload_size = p->offsets[block_count];
+    if (payload_size > remaining) {
+        container_destroy(p);
+        return NULL;
+    }
+    p->payload = calloc(payload_size + BITSTREAM_PADDING + CONTAINER_CHECKSUM_CHUNK * HFCODE_MAX_BITS / 8, 1);
+    if (!p->payload || fread(p->payload, 1, payload_size, file) != payload_size) {
+        container_destroy(p);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < 256; i++) {
+        p->dict[i].bit_length = lengths[i];
+    }
+    hfcode_canonicalize(p->dict, 256);
+    p->decoder = hfdecoder_new(lengths, 256);
+
+    return p;
+}
+
+void test_container() {
+    // a short sentence followed by a long run of 'z'
+    const char *text = "she sells sea shells by the sea shore";
+    uint8_t in[256];
+    memset(in, 'z', sizeof(in));
+    memcpy(in, text, strlen(text));
+
+    struct container *p = container_new(sizeof(in), 64);
+    container_compress(p, in);
+
+    uint8_t out[256] = {0};
+    uint8_t corrupted[4];
+    assert(container_decode(p, out, NULL) == 0);
+    assert(memcmp(out, in, sizeof(in)) == 0);
+
+    assert(p->modes[0] == BLOCK_HUFFMAN);
+    assert(p->modes[p->block_count - 1] == BLOCK_RLE);
+
+    assert(container_decompress_range(p, 10, 15, out, NULL) == 0);
+    assert(memcmp(out, in + 10, 15) == 0);
+    assert(container_decompress_range(p, 60, 100, out, NULL) == 0);
+    assert(memcmp(out, in + 60, 100) == 0);
+    assert(container_decompress_range(p, 200, 57, out, NULL) == -1);
+    assert(container_decompress_range(p, 1, UINT64_MAX, out, NULL) == -1);
+
+    // flipped bits in two blocks are reported against those blocks only
+    p->payload[p->offsets[0]] ^= 1;
+    p->payload[p->offsets[p->block_count - 1]] ^= 1;
+    assert(container_decode(p, out, corrupted) == 2);
+    assert(corrupted[0] && !corrupted[1] && !corrupted[2] && corrupted[3]);
+    assert(container_decompress_range(p, 64, 64, out, NULL) == 0);
+
+    container_destroy(p);
+
+    // the same input through LZ77: the sentence block has no repeats, the
+    // runs become a few long matches
+    p = container_new(sizeof(in), 64);
+    p->lz77 = 1;
+    container_compress(p, in);
+
+    memset(out, 0, sizeof(out));
+    assert(container_decode(p, out, NULL) == 0);
+    assert(memcmp(out, in, sizeof(in)) == 0);
+    assert(container_decompress_range(p, 60, 100, out, NULL) == 0);
+    assert(memcmp(out, in + 60, 100) == 0);
+
+    container_destroy(p);
+}
@@ -0,0 +1,106 @@
+#include "container.h"
+#include "huffman.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#define BENCH_MIN_BITS 4
+#define BENCH_MAX_BITS 16
+
+// decodes the Huffman blocks of the container with a decoder of each primary table
+// width and reports the throughput, to show where the table stops fitting in L1;
+// hfdecoder_decode is timed on its own (one thread, no checksums, no other modes)
+// so that only the table width changes between rows
+void bench_decode(struct container *c, uint8_t *reference, int repetitions) {
+    uint8_t lengths[256];
+    for (size_t i = 0; i < 256; i++) {
+        lengths[i] = c->dict[i].bit_length;
+    }
+
+    uint64_t decoded = 0;
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        if (c->modes[b] == BLOCK_HUFFMAN) {
+            decoded += container_block_length(c, b);
+        }
+    }
+    if (decoded == 0) {
+        fprintf(stderr, "no Huffman coded blocks to decode\n");
+        exit(1);
+    }
+
+    uint8_t *out = malloc(c->size + 1);
+    printf("%6s %12s %12s %10s\n", "bits", "table bytes", "MB/s", "default");
+    for (uint8_t bits = BENCH_MIN_BITS; bits <= BENCH_MAX_BITS; bits++) {
+        struct hfdecoder *decoder = hfdecoder_new_with_width(lengths, 256, bits);
+
+        double best = 0;
+        for (int r = 0; r < repetitions; r++) {
+            double start = omp_get_wtime();
+            for (uint64_t b = 0; b < c->block_count; b++) {
+                if (c->modes[b] == BLOCK_HUFFMAN) {
+                    hfdecoder_decode(decoder, c->payload + c->offsets[b], 0,
+                                     out + b * c->block_size, container_block_length(c, b));
+                }
+            }
+            double duration = omp_get_wtime() - start;
+            if (best == 0 || duration < best) {
+                best = duration;
+            }
+        }
+
+        for (uint64_t b = 0; b < c->block_count; b++) {
+            uint64_t start = b * c->block_size;
+            if (c->modes[b] == BLOCK_HUFFMAN &&
+                memcmp(out + start, reference + start, container_block_length(c, b)) != 0) {
+                fprintf(stderr, "decoding mismatch with a %u-bit table\n", bits);
+                exit(1);
+            }
+        }
+
+        printf("%6u %12lu %12.1f %10s\n", bits, decoder->size * sizeof(uint32_t),
+               decoded / best / 1e6, bits == c->decoder->table_bits ? "*" : "");
+        hfdecoder_destroy(decoder);
+    }
+
+    free(out);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: ./decode_bench <filename> [repetitions]\n");
+        exit(1);
+    }
+
+    int repetitions = argc == 3 ? atoi(argv[2]) : 5;
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", argv[1], strerror(errno));
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t filesize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *buf = malloc(filesize + 1);
+    if (!buf) {
+        fprintf(stderr, "unable to allocate memory for reading the file\n");
+        exit(1);
+    }
+    size_t read = fread(buf, 1, filesize, file);
+    fclose(file);
+
+    struct container *c = container_new(read, CONTAINER_DEFAULT_BLOCK_SIZE);
+    container_compress(c, buf);
+
+    printf("%s: %lu bytes\n", argv[1], read);
+    bench_decode(c, buf, repetitions);
+
+    container_destroy(c);
+    free(buf);
+}
@@ -1,14 +1,15 @@
 #include "huffman.h"
 #include "minheap.h"
+#include "bitstream.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
-struct hftree* hftree_new(uint64_t *frequencies) {
-    struct hftree *p = calloc(1, sizeof(*p));
-    p->minheap = minheap_new();
-    p->size = 0;
+#include <omp.h>
 
+void hftree_fill(struct hftree *p, uint64_t *frequencies) {
     for (size_t i = 0; i < 256; i++) {
         if (frequencies[i] == 0) {
             continue;
@@ -20,6 +21,14 @@ struct hftree* hftree_new(uint64_t *frequencies) {
 
         minheap_insert(p->minheap, t);
     }
+}
+
+struct hftree* hftree_new(uint64_t *frequencies) {
+    struct hftree *p = calloc(1, sizeof(*p));
+    p->minheap = minheap_new();
+    p->size = 0;
+
+    hftree_fill(p, frequencies);
 
     return p;
 }
@@ -95,28 +104,461 @@ void hftree_print(struct hftree *p) {
     hftree_print_rec(p->root, 0, 0);
 }
 
-void hftree_collect_codes(struct node *t, struct hfcode *dict,
-                          uint8_t path, uint8_t length) {
-    // we walk the tree in-order and collect the path values
-    // from the leaf nodes
+void hftree_collect_lengths(struct node *t, struct hfcode *dict, uint8_t length) {
+    // we walk the tree and collect the depth of the leaf nodes;
+    // the codes themselves are assigned canonically afterwards
     if (!t) {
         return;
     }
 
     if (t->type == NODE_LEAF) {
-        // printf("writing entry: (0x%02x, 0b%b:%u)\n", t->symbol, path, length);
-        // printf("writing entry: ('0x%02x=%c', 0b%b:%u)\n", t->symbol, t->symbol, path, length);
-        dict[t->symbol].code = path;
         dict[t->symbol].bit_length = length;
     }
 
-    hftree_collect_codes(t->left, dict, (path << 1) | 0, length + 1);
-    hftree_collect_codes(t->right, dict, (path << 1) | 1, length + 1);
+    hftree_collect_lengths(t->left, dict, length + 1);
+    hftree_collect_lengths(t->right, dict, length + 1);
+}
+
+void hftree_collect_frequencies(struct node *t, uint64_t *frequencies) {
+    if (!t) {
+        return;
+    }
+
+    if (t->type == NODE_LEAF) {
+        frequencies[t->symbol] = t->frequency;
+    }
+
+    hftree_collect_frequencies(t->left, frequencies);
+    hftree_collect_frequencies(t->right, frequencies);
+}
+
+uint8_t hfcode_max_length(struct hfcode *dict) {
+    uint8_t max = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (dict[i].bit_length > max) {
+            max = dict[i].bit_length;
+        }
+    }
+    return max;
+}
+
+void hfcode_canonicalize(struct hfcode *dict, size_t n) {
+    uint32_t count[HFCODE_MAX_BITS + 1] = {0};
+    uint32_t next_code[HFCODE_MAX_BITS + 1] = {0};
+
+    for (size_t i = 0; i < n; i++) {
+        count[dict[i].bit_length]++;
+    }
+    count[0] = 0;
+
+    // shorter codes come first, and codes of the same length are
+    // consecutive integers ordered by symbol (as in DEFLATE)
+    uint32_t code = 0;
+    for (size_t len = 1; len <= HFCODE_MAX_BITS; len++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t len = dict[i].bit_length;
+        if (len != 0) {
+            dict[i].code = next_code[len]++;
+        }
+    }
 }
 
 void hftree_generate_dict(struct hftree *p, struct hfcode *dict) {
     hftree_build(p);
-    hftree_collect_codes(p->root, dict, 0, 0);
+    hftree_collect_lengths(p->root, dict, 0);
+
+    // a tree with a single leaf still needs one bit per symbol
+    if (p->root && p->root->type == NODE_LEAF) {
+        dict[p->root->symbol].bit_length = 1;
+    }
+
+    // very skewed inputs can grow the tree past HFCODE_MAX_BITS levels;
+    // flatten the frequencies and rebuild until it fits
+    while (hfcode_max_length(dict) > HFCODE_MAX_BITS) {
+        uint64_t frequencies[256] = {0};
+        hftree_collect_frequencies(p->root, frequencies);
+        for (size_t i = 0; i < 256; i++) {
+            if (frequencies[i] != 0) {
+                frequencies[i] = (frequencies[i] >> 1) | 1;
+            }
+        }
+
+        hftree_destroy_node_rec(p->root);
+        hftree_fill(p, frequencies);
+        hftree_build(p);
+        hftree_collect_lengths(p->root, dict, 0);
+    }
+
+    hfcode_canonicalize(dict, 256);
+}
+
+// one (frequency, symbol) pair of the sort-based construction
+struct hfweight {
+    uint64_t frequency;
+    uint32_t symbol;
+};
+
+int hfweight_compare(const void *a, const void *b) {
+    const struct hfweight *x = a, *y = b;
+    if (x->frequency != y->frequency) {
+        return x->frequency < y->frequency ? -1 : 1;
+    }
+    return x->symbol < y->symbol ? -1 : (x->symbol > y->symbol);
+}
+
+// below this many elements a sort task just calls qsort
+#define HFWEIGHT_SORT_CUTOFF 4096
+
+void hfweight_sort(struct hfweight *a, struct hfweight *tmp, size_t n) {
+    if (n <= HFWEIGHT_SORT_CUTOFF) {
+        qsort(a, n, sizeof(*a), hfweight_compare);
+        return;
+    }
+
+    size_t half = n / 2;
+    #pragma omp task
+    hfweight_sort(a, tmp, half);
+    #pragma omp task
+    hfweight_sort(a + half, tmp + half, n - half);
+    #pragma omp taskwait
+
+    // merge both halves through tmp
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        tmp[k++] = hfweight_compare(&a[i], &a[j]) <= 0 ? a[i++] : a[j++];
+    }
+    while (i < half) {
+        tmp[k++] = a[i++];
+    }
+    while (j < n) {
+        tmp[k++] = a[j++];
+    }
+    memcpy(a, tmp, n * sizeof(*a));
+}
+
+// in-place computation of minimum-redundancy code lengths (Moffat and Katajainen):
+// on input A holds the weights in ascending order, on output the code lengths
+void hflengths_in_place(uint64_t *A, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        A[0] = 0;
+        return;
+    }
+
+    // first pass, left to right: build the internal nodes, leaving parent pointers behind
+    size_t root = 0, leaf = 2, next;
+    A[0] += A[1];
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+
+    // second pass, right to left: depth of every internal node
+    A[n - 2] = 0;
+    for (size_t k = n - 2; k-- > 0;) {
+        A[k] = A[A[k]] + 1;
+    }
+
+    // third pass, right to left: depth of every leaf
+    int64_t available = 1, used = 0, depth = 0;
+    int64_t r = (int64_t) n - 2, k = (int64_t) n - 1;
+    while (available > 0) {
+        while (r >= 0 && A[r] == (uint64_t) depth) {
+            used++;
+            r--;
+        }
+        while (available > used) {
+            A[k--] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+void hflengths_build(const uint64_t *frequencies, size_t n, uint8_t *lengths, uint8_t max_bits) {
+    struct hfweight *weights = malloc(n * sizeof(*weights));
+    size_t used = 0;
+
+    memset(lengths, 0, n);
+    for (size_t i = 0; i < n; i++) {
+        if (frequencies[i] != 0) {
+            weights[used].frequency = frequencies[i];
+            weights[used].symbol = (uint32_t) i;
+            used++;
+        }
+    }
+
+    if (used == 0) {
+        free(weights);
+        return;
+    }
+
+    // a lone symbol still needs one bit per occurrence
+    if (used == 1) {
+        lengths[weights[0].symbol] = 1;
+        free(weights);
+        return;
+    }
+
+    struct hfweight *tmp = malloc(used * sizeof(*tmp));
+    if (omp_get_level() == 0) {
+        #pragma omp parallel
+        #pragma omp single
+        hfweight_sort(weights, tmp, used);
+    } else {
+        hfweight_sort(weights, tmp, used);
+    }
+
+    uint64_t *A = (uint64_t *) tmp;
+    for (size_t i = 0; i < used; i++) {
+        A[i] = weights[i].frequency;
+    }
+    hflengths_in_place(A, used);
+
+    // limit the lengths: clamp everything to max_bits, then pay back the
+    // Kraft overflow (in units of 2^-max_bits) by lengthening the least
+    // frequent codes that still have room
+    int64_t kraft = -((int64_t) 1 << max_bits);
+    for (size_t i = 0; i < used; i++) {
+        if (A[i] > max_bits) {
+            A[i] = max_bits;
+        }
+        kraft += (int64_t) 1 << (max_bits - A[i]);
+    }
+
+    while (kraft > 0) {
+        for (size_t i = 0; i < used && kraft > 0; i++) {
+            if (A[i] < max_bits) {
+                A[i]++;
+                kraft -= (int64_t) 1 << (max_bits - A[i]);
+            }
+        }
+    }
+
+    // the lengthening may have overshot: spend the slack on the most frequent codes
+    for (size_t i = used; i-- > 0;) {
+        while (A[i] > 1 && kraft + ((int64_t) 1 << (max_bits - A[i])) <= 0) {
+            kraft += (int64_t) 1 << (max_bits - A[i]);
+            A[i]--;
+        }
+    }
+
+    for (size_t i = 0; i < used; i++) {
+        lengths[weights[i].symbol] = (uint8_t) A[i];
+    }
+
+    free(tmp);
+    free(weights);
+}
+
+int hflengths_valid(const uint8_t *lengths, size_t n, uint8_t max_bits) {
+    // Kraft sum in units of 2^-max_bits
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (lengths[i] > max_bits) {
+            return 0;
+        }
+        if (lengths[i] != 0) {
+            kraft += (uint64_t) 1 << (max_bits - lengths[i]);
+        }
+    }
+    return kraft <= ((uint64_t) 1 << max_bits);
+}
+
+struct hfdecoder* hfdecoder_new_with_width(const uint8_t *lengths, size_t n, uint8_t table_bits) {
+    struct hfdecoder *p = calloc(1, sizeof(*p));
+    p->table_bits = table_bits;
+
+    struct hfcode *dict = calloc(n, sizeof(*dict));
+    for (size_t i = 0; i < n; i++) {
+        dict[i].bit_length = lengths[i];
+    }
+    hfcode_canonicalize(dict, n);
+
+    // first pass: size the second-level table of every primary slot
+    // that is a prefix of a code longer than the primary table
+    uint32_t primary = 1u << table_bits;
+    uint8_t *sub_bits = calloc(primary, 1);
+    for (size_t i = 0; i < n; i++) {
+        uint8_t len = dict[i].bit_length;
+        if (len > table_bits) {
+            uint32_t prefix = dict[i].code >> (len - table_bits);
+            if (len - table_bits > sub_bits[prefix]) {
+                sub_bits[prefix] = len - table_bits;
+            }
+        }
+    }
+
+    p->size = primary;
+    for (uint32_t prefix = 0; prefix < primary; prefix++) {
+        if (sub_bits[prefix]) {
+            p->size += 1u << sub_bits[prefix];
+        }
+    }
+    p->table = calloc(p->size, sizeof(uint32_t));
+
+    uint32_t next = primary;
+    for (uint32_t prefix = 0; prefix < primary; prefix++) {
+        if (sub_bits[prefix]) {
+            p->table[prefix] = HFDECODER_LINK | ((uint32_t) sub_bits[prefix] << 24) | next;
+            next += 1u << sub_bits[prefix];
+        }
+    }
+
+    // second pass: a code of length len fills every entry whose index
+    // starts with it, i.e. 2^(width - len) consecutive entries
+    for (size_t i = 0; i < n; i++) {
+        uint8_t len = dict[i].bit_length;
+        uint32_t code = dict[i].code;
+        uint32_t entry = ((uint32_t) len << 16) | (uint32_t) i;
+
+        if (len == 0) {
+            continue;
+        }
+
+        uint32_t *table = p->table;
+        uint8_t width = table_bits;
+        uint8_t rest = len;
+        if (len > table_bits) {
+            uint32_t link = p->table[code >> (len - table_bits)];
+            table = p->table + (link & 0xFFFFFF);
+            width = (link >> 24) & 0x1F;
+            rest = len - table_bits;
+            code &= (1u << rest) - 1;
+        }
+
+        uint32_t first = code << (width - rest);
+        uint32_t count = 1u << (width - rest);
+        for (uint32_t j = 0; j < count; j++) {
+            table[first + j] = entry;
+        }
+    }
+
+    free(sub_bits);
+    free(dict);
+    return p;
+}
+
+struct hfdecoder* hfdecoder_new(const uint8_t *lengths, size_t n) {
+    uint8_t table_bits = 0;
+    while ((sizeof(uint32_t) << (table_bits + 1)) <= HFDECODER_L1_BUDGET) {
+        table_bits++;
+    }
+
+    // no point in a table wider than the longest code
+    uint8_t longest = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (lengths[i] > longest) {
+            longest = lengths[i];
+        }
+    }
+
+    return hfdecoder_new_with_width(lengths, n, table_bits < longest ? table_bits : longest);
+}
+
+void hfdecoder_destroy(struct hfdecoder *p) {
+    free(p->table);
+    free(p);
+}
+
+uint64_t hfdecoder_decode(struct hfdecoder *p, const uint8_t *buf,
+                          uint64_t bit_offset, uint8_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (uint8_t) hfdecoder_next(p, buf, &bit_offset);
+    }
+
+    return bit_offset;
+}
+
+uint64_t hfdecoder_decode16(struct hfdecoder *p, const uint8_t *buf,
+                            uint64_t bit_offset, uint16_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = hfdecoder_next(p, buf, &bit_offset);
+    }
+
+    return bit_offset;
+}
+
+void test_hfdecoder() {
+    // lengths 1, 2, 3, 3 -> canonical codes 0, 10, 110, 111
+    uint8_t lengths[256] = {0};
+    lengths['a'] = 1;
+    lengths['b'] = 2;
+    lengths['c'] = 3;
+    lengths['d'] = 3;
+
+    // "abcda" = 0 10 110 111 0 = 0b01011011 0b10...
+    uint8_t buf[16] = {0b01011011, 0b10000000};
+    uint8_t out[5];
+
+    // both a single-level table and one that needs second-level lookups
+    for (uint8_t width = 1; width <= 3; width++) {
+        struct hfdecoder *p = hfdecoder_new_with_width(lengths, 256, width);
+        uint64_t end = hfdecoder_decode(p, buf, 0, out, 5);
+        assert(end == 10);
+        assert(out[0] == 'a' && out[1] == 'b' && out[2] == 'c' && out[3] == 'd' && out[4] == 'a');
+        hfdecoder_destroy(p);
+    }
+}
+
+void test_hflengths_valid() {
+    uint8_t complete[4] = {1, 2, 3, 3};
+    assert(hflengths_valid(complete, 4, HFCODE_MAX_BITS));
+
+    // a lone symbol of length 1 is an incomplete but valid code
+    uint8_t lone[4] = {0, 1, 0, 0};
+    assert(hflengths_valid(lone, 4, HFCODE_MAX_BITS));
+
+    uint8_t oversubscribed[3] = {1, 1, 1};
+    assert(!hflengths_valid(oversubscribed, 3, HFCODE_MAX_BITS));
+
+    uint8_t too_long[2] = {1, 200};
+    assert(!hflengths_valid(too_long, 2, HFCODE_MAX_BITS));
+}
+
+void test_hflengths_build() {
+    // same frequencies as the commented example below: 40, 35, 20, 5
+    uint64_t frequencies[5] = {0, 40, 35, 20, 5};
+    uint8_t lengths[5];
+
+    hflengths_build(frequencies, 5, lengths, HFCODE_MAX_BITS);
+    assert(lengths[0] == 0 && lengths[1] == 1 && lengths[2] == 2);
+    assert(lengths[3] == 3 && lengths[4] == 3);
+
+    // fibonacci weights make a maximally deep tree, which must be limited
+    uint64_t fibonacci[32];
+    uint8_t limited[32];
+    fibonacci[0] = fibonacci[1] = 1;
+    for (size_t i = 2; i < 32; i++) {
+        fibonacci[i] = fibonacci[i - 1] + fibonacci[i - 2];
+    }
+
+    hflengths_build(fibonacci, 32, limited, 8);
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < 32; i++) {
+        assert(limited[i] >= 1 && limited[i] <= 8);
+        kraft += 1u << (8 - limited[i]);
+    }
+    assert(kraft <= 1u << 8);
 }
 
 // int main(int argc, char **argv) {
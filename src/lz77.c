@@ -0,0 +1,332 @@
+#include "lz77.h"
+#include "huffman.h"
+#include "bitstream.h"
+#include "crc32c.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// struct for the matcher state of a single block
+struct lz77_matcher {
+    const uint8_t *in;
+    size_t length;
+    int32_t head[1 << LZ77_HASH_BITS];  // most recent position of each hash
+    int32_t *prev;                      // previous position with the same hash
+};
+
+// struct for the tokens of a block: a literal has dist 0
+struct lz77_tokens {
+    uint16_t *value;    // literal byte or match length
+    uint16_t *dist;     // match distance
+    size_t count;
+};
+
+// index of the last entry of base that is <= value
+size_t lz77_code(const uint16_t *base, size_t n, uint32_t value) {
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (base[mid] <= value) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+uint32_t lz77_hash(const uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - LZ77_HASH_BITS);
+}
+
+// inserts position i in the hash chains and returns the previous head
+int32_t lz77_insert(struct lz77_matcher *m, size_t i) {
+    if (i + LZ77_MIN_MATCH > m->length) {
+        return -1;
+    }
+    uint32_t h = lz77_hash(m->in + i);
+    m->prev[i] = m->head[h];
+    m->head[h] = (int32_t) i;
+    return m->prev[i];
+}
+
+// walks the chain starting at candidate and returns the longest match at i
+size_t lz77_longest_match(struct lz77_matcher *m, size_t i, int32_t candidate, size_t *dist) {
+    size_t best = 0;
+    size_t limit = m->length - i < LZ77_MAX_MATCH ? m->length - i : LZ77_MAX_MATCH;
+    const uint8_t *cur = m->in + i;
+
+    for (int chain = 0; candidate >= 0 && chain < LZ77_MAX_CHAIN; chain++) {
+        if (i - candidate > LZ77_WINDOW) {
+            break;
+        }
+
+        const uint8_t *ref = m->in + candidate;
+        // cheap rejection: the byte that would extend the best match must agree
+        if (ref[best] == cur[best] || best == 0) {
+            size_t len = 0;
+            while (len < limit && ref[len] == cur[len]) {
+                len++;
+            }
+            if (len > best) {
+                best = len;
+                *dist = i - candidate;
+                if (len == limit) {
+                    break;
+                }
+            }
+        }
+        candidate = m->prev[candidate];
+    }
+
+    return best >= LZ77_MIN_MATCH ? best : 0;
+}
+
+void lz77_push(struct lz77_tokens *t, uint16_t value, uint16_t dist) {
+    t->value[t->count] = value;
+    t->dist[t->count] = dist;
+    t->count++;
+}
+
+// greedy parsing with one step of lazy evaluation (as zlib does): a match is
+// only taken if the match starting at the next byte is not longer
+void lz77_parse(const uint8_t *in, size_t length, struct lz77_tokens *t) {
+    struct lz77_matcher *m = malloc(sizeof(*m));
+    m->in = in;
+    m->length = length;
+    m->prev = malloc((length + 1) * sizeof(int32_t));
+    memset(m->head, 0xFF, sizeof(m->head));
+
+    size_t prev_len = 0, prev_dist = 0;
+    int available = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        int32_t candidate = lz77_insert(m, i);
+        size_t len = 0, dist = 0;
+        if (candidate >= 0 && prev_len < LZ77_LAZY_LIMIT) {
+            len = lz77_longest_match(m, i, candidate, &dist);
+        }
+
+        if (prev_len >= LZ77_MIN_MATCH && len <= prev_len) {
+            // the match found at i - 1 wins: emit it and skip over it
+            lz77_push(t, (uint16_t) prev_len, (uint16_t) prev_dist);
+            size_t end = i - 1 + prev_len;
+            for (size_t j = i + 1; j < end; j++) {
+                lz77_insert(m, j);
+            }
+            i = end - 1;
+            available = 0;
+            prev_len = 0;
+        } else if (available) {
+            lz77_push(t, in[i - 1], 0);
+            prev_len = len;
+            prev_dist = dist;
+        } else {
+            available = 1;
+            prev_len = len;
+            prev_dist = dist;
+        }
+    }
+
+    if (available) {
+        lz77_push(t, in[length - 1], 0);
+    }
+
+    free(m->prev);
+    free(m);
+}
+
+struct bitstream* lz77_encode_block(const uint8_t *in, size_t length) {
+    struct lz77_tokens t;
+    t.value = malloc((length + 1) * sizeof(uint16_t));
+    t.dist = malloc((length + 1) * sizeof(uint16_t));
+    t.count = 0;
+    lz77_parse(in, length, &t);
+
+    uint64_t litlen_freq[LZ77_LITLEN_SYMBOLS] = {0};
+    uint64_t dist_freq[LZ77_DIST_SYMBOLS] = {0};
+    for (size_t k = 0; k < t.count; k++) {
+        if (t.dist[k] == 0) {
+            litlen_freq[t.value[k]]++;
+        } else {
+            litlen_freq[257 + lz77_code(length_base, 29, t.value[k])]++;
+            dist_freq[lz77_code(dist_base, 30, t.dist[k])]++;
+        }
+    }
+
+    // same canonical machinery as the byte path, over the larger alphabets
+    uint8_t litlen_lengths[LZ77_LITLEN_SYMBOLS];
+    uint8_t dist_lengths[LZ77_DIST_SYMBOLS];
+    struct hfcode litlen_dict[LZ77_LITLEN_SYMBOLS] = {0};
+    struct hfcode dist_dict[LZ77_DIST_SYMBOLS] = {0};
+    hflengths_build(litlen_freq, LZ77_LITLEN_SYMBOLS, litlen_lengths, LZ77_MAX_BITS);
+    hflengths_build(dist_freq, LZ77_DIST_SYMBOLS, dist_lengths, LZ77_MAX_BITS);
+    for (size_t i = 0; i < LZ77_LITLEN_SYMBOLS; i++) {
+        litlen_dict[i].bit_length = litlen_lengths[i];
+    }
+    for (size_t i = 0; i < LZ77_DIST_SYMBOLS; i++) {
+        dist_dict[i].bit_length = dist_lengths[i];
+    }
+    hfcode_canonicalize(litlen_dict, LZ77_LITLEN_SYMBOLS);
+    hfcode_canonicalize(dist_dict, LZ77_DIST_SYMBOLS);
+
+    // worst case: 15 bits per literal, 15 + 5 + 15 + 13 bits per match of 3 or more bytes
+    struct bitstream *ostream = bitstream_new(LZ77_LITLEN_SYMBOLS + LZ77_DIST_SYMBOLS + 2 * length + 1);
+    memcpy(ostream->buf, litlen_lengths, LZ77_LITLEN_SYMBOLS);
+    memcpy(ostream->buf + LZ77_LITLEN_SYMBOLS, dist_lengths, LZ77_DIST_SYMBOLS);
+    ostream->offset = 8 * (LZ77_LITLEN_SYMBOLS + LZ77_DIST_SYMBOLS);
+
+    for (size_t k = 0; k < t.count; k++) {
+        if (t.dist[k] == 0) {
+            struct hfcode c = litlen_dict[t.value[k]];
+            bitstream_push_chunk(ostream, c.code, c.bit_length);
+            continue;
+        }
+
+        size_t lc = lz77_code(length_base, 29, t.value[k]);
+        struct hfcode c = litlen_dict[257 + lc];
+        bitstream_push_chunk(ostream, c.code, c.bit_length);
+        bitstream_push_chunk(ostream, t.value[k] - length_base[lc], length_extra[lc]);
+
+        size_t dc = lz77_code(dist_base, 30, t.dist[k]);
+        c = dist_dict[dc];
+        bitstream_push_chunk(ostream, c.code, c.bit_length);
+        bitstream_push_chunk(ostream, t.dist[k] - dist_base[dc], dist_extra[dc]);
+    }
+
+    free(t.value);
+    free(t.dist);
+    return ostream;
+}
+
+// reads n (<= 16) raw bits at *bit_offset
+static inline uint32_t lz77_read_bits(const uint8_t *buf, uint64_t *bit_offset, uint8_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    uint32_t bits = bitstream_peek(buf, *bit_offset) >> (32 - n);
+    *bit_offset += n;
+    return bits;
+}
+
+int lz77_decode_block(const uint8_t *buf, size_t size, uint8_t *out, size_t n, uint32_t *checksum) {
+    // the code lengths come from the block itself, so they are checked
+    // before any table is built from them
+    size_t header = LZ77_LITLEN_SYMBOLS + LZ77_DIST_SYMBOLS;
+    if (size < header || buf[256] != 0 ||
+        !hflengths_valid(buf, LZ77_LITLEN_SYMBOLS, LZ77_MAX_BITS) ||
+        !hflengths_valid(buf + LZ77_LITLEN_SYMBOLS, LZ77_DIST_SYMBOLS, LZ77_MAX_BITS)) {
+        return -1;
+    }
+
+    struct hfdecoder *litlen = hfdecoder_new(buf, LZ77_LITLEN_SYMBOLS);
+    struct hfdecoder *dist = hfdecoder_new(buf + LZ77_LITLEN_SYMBOLS, LZ77_DIST_SYMBOLS);
+    uint64_t bit_offset = 8 * header;
+    uint64_t bits = 8 * (uint64_t) size;
+    int status = 0;
+
+    size_t i = 0, hashed = 0;
+    while (i < n) {
+        if (checksum && i - hashed >= LZ77_CHECKSUM_CHUNK) {
+            *checksum = crc32c_update(*checksum, out + hashed, i - hashed);
+            hashed = i;
+        }
+
+        // a corrupted stream may run past the end of the block
+        if (bit_offset > bits) {
+            status = -1;
+            break;
+        }
+
+        uint16_t symbol = hfdecoder_next(litlen, buf, &bit_offset);
+        if (symbol < 256) {
+            out[i++] = (uint8_t) symbol;
+            continue;
+        }
+
+        // the end of block symbol is never emitted
+        if (symbol == 256 || symbol >= LZ77_LITLEN_SYMBOLS) {
+            status = -1;
+            break;
+        }
+
+        size_t lc = symbol - 257;
+        size_t len = length_base[lc] + lz77_read_bits(buf, &bit_offset, length_extra[lc]);
+        size_t dc = hfdecoder_next(dist, buf, &bit_offset);
+        if (dc >= LZ77_DIST_SYMBOLS) {
+            status = -1;
+            break;
+        }
+        size_t d = dist_base[dc] + lz77_read_bits(buf, &bit_offset, dist_extra[dc]);
+
+        // a corrupted block could point before its start
+        if (d > i) {
+            status = -1;
+            break;
+        }
+
+        // byte by byte, since the source may overlap the destination;
+        // the last match is clipped when only a prefix is wanted
+        if (len > n - i) {
+            len = n - i;
+        }
+        for (size_t k = 0; k < len; k++, i++) {
+            out[i] = out[i - d];
+        }
+    }
+
+    if (checksum && status == 0) {
+        *checksum = crc32c_update(*checksum, out + hashed, i - hashed);
+    }
+
+    hfdecoder_destroy(litlen);
+    hfdecoder_destroy(dist);
+    return status;
+}
+
+void test_lz77() {
+    const char *text = "abcabcabcabcabcabc, she sells sea shells, she sells sea shells by the shore";
+    size_t length = strlen(text);
+
+    struct bitstream *p = lz77_encode_block((const uint8_t *) text, length);
+
+    uint8_t out[128] = {0};
+    assert(lz77_decode_block(p->buf, bitstream_size(p), out, length, NULL) == 0);
+    assert(memcmp(out, text, length) == 0);
+
+    // a prefix ending in the middle of a match
+    memset(out, 0, sizeof(out));
+    assert(lz77_decode_block(p->buf, bitstream_size(p), out, 10, NULL) == 0);
+    assert(memcmp(out, text, 10) == 0 && out[10] == 0);
+
+    // the checksum is the one of the decoded bytes
+    uint32_t checksum = 0;
+    assert(lz77_decode_block(p->buf, bitstream_size(p), out, length, &checksum) == 0);
+    assert(checksum == crc32c_update(0, (const uint8_t *) text, length));
+
+    // code lengths that do not form a prefix code are rejected up front
+    p->buf[0] = 60;
+    assert(lz77_decode_block(p->buf, bitstream_size(p), out, length, NULL) == -1);
+
+    bitstream_destroy(p);
+}
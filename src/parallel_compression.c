@@ -1,192 +1,162 @@
 #include "parallel_compression.h"
 #include "huffman.h"
+#include "container.h"
+#include "autotune.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <unistd.h>
 
 #include <omp.h>
 
-struct bitstream* bitstream_new(size_t capacity) {
-    struct bitstream *p = malloc(sizeof(struct bitstream));
-    p->buf = calloc(capacity, 1);
-    p->capacity = capacity;
-    p->length = 0;
-    p->offset = 0;
-
+struct parallel_compressor* parallel_compressor_new(uint8_t *input, size_t size, int threads,
+                                                    uint32_t checkpoint_interval, double sample_rate, int lz77) {
+    struct parallel_compressor *p = calloc(1, sizeof(*p));
+    p->in = input;
+    p->in_size = size;
+    p->threads = threads;
+    p->checkpoint_interval = checkpoint_interval;
+    p->sample_rate = sample_rate;
+    p->container = container_new(size, checkpoint_interval);
+    p->container->lz77 = lz77;
+    p->container->threads = threads;
     return p;
 }
 
-void bitstream_destroy(struct bitstream *p) {
-    free(p->buf);
+void parallel_compressor_destroy(struct parallel_compressor *p) {
+    container_destroy(p->container);
     free(p);
 }
 
-void bitstream_print(struct bitstream *p) {
-    printf("offset=%lu\n", p->offset);
-    printf("[ ");
-    size_t size = (p->offset % 8 == 0) ? p->offset / 8 : p->offset / 8 + 1;
-    for (uint64_t i = 0; i < size; i++) {
-        printf("%08b ", p->buf[i]);
-    }
-    printf("]\n");
-}
+void parallel_compressor_generate_frequency_table(struct parallel_compressor *p) {
+    struct container *c = p->container;
 
-// 1 byte chunks
-// TODO: should probably inline this
-void bitstream_push_chunk(struct bitstream *p, uint8_t chunk, uint8_t bit_length) {
-    // how many bits between the stream's current offset and the next byte boundary
-    uint64_t byte_offset = p->offset / 8;
-    uint8_t offset_within_byte = p->offset % 8;
-    uint8_t last_byte = p->buf[byte_offset];
-
-    /**
-     *
-     *      offset_within_byte
-     *        |----------|                               chunk we'd like to push
-     *         1   1   0   _   _   _   _   _          1   1   1   0   1   1   1   _
-     *        |-----------------------------|        |-----------------------------|
-     *                  8 bits
-     *
-     *        how to merge these (considering the push might cross the byte boundary)?
-     *        we expand both to 16 bits, right shift our chunk by offset_within_bytes bits,
-     *        OR both parts together and then convert back to two 8-bit chunks:
-     *
-     *                   original byte chunk expanded to 16 bits
-     *       |-------------------------------------------------------------|
-     *        1   1   0   _   _   _   _   _ | _   _   _   _   _   _   _   _
-     *        0   0   0   1   1   1   0   1 | 1   1   _   _   _   _   _   _
-     *                   |-------------------------|
-     *                  out chunk expanded to 16 bits
-     *           and shifted offset_within_byte = 3 units to the right
-     *
-     */
-    
-    uint16_t expanded_original_byte = last_byte << 8;
-    uint16_t expanded_and_shifted_chunk = (chunk << (16 - bit_length)) >> offset_within_byte;
-    uint16_t result = expanded_original_byte | expanded_and_shifted_chunk;
-
-    // we now push the two resulting bytes to the end of our buffer
-    // the mask might be redundant because of the cast but better safe than sorry
-    p->buf[byte_offset] = (uint8_t) (result >> 8);
-    p->buf[byte_offset + 1] = (uint8_t) (result & 0xFF);
-    p->offset += bit_length;
-    // printf("bitstream currently at offset=%lu (grew %u bits)\n", p->offset, bit_length);
-}
+    // every checkpoint interval keeps its own histogram, which later gives
+    // us the exact encoded size of each interval
+    if (p->sample_rate >= 1.0) {
+        #pragma omp parallel for schedule(static) num_threads(p->threads) if(p->threads > 1)
+        for (uint64_t b = 0; b < c->block_count; b++) {
+            container_count_block(c, p->in, b);
+        }
+        return;
+    }
 
-void test_bitstream_push_chunk() {
-    struct bitstream *p = bitstream_new(16);
-    bitstream_push_chunk(p, 0b1101, 4);
-    assert(p->buf[0] == 0b11010000);
-    assert(p->offset == 4);
-    bitstream_push_chunk(p, 0b111111, 6);
-    assert(p->buf[0] == 0b11011111 && p->buf[1] == 0b11000000);
-    assert(p->offset == 10);
-    bitstream_destroy(p);
+    // sampling mode: only one window out of every stride bytes is read
+    uint64_t stride = CONTAINER_SAMPLE_WINDOW / p->sample_rate;
+    #pragma omp parallel for schedule(static) num_threads(p->threads) if(p->threads > 1)
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        container_sample_block(c, p->in, b, stride);
+    }
 }
 
-void bitstream_append(struct bitstream *p, struct bitstream *q) {
-    size_t idx = p->offset / 8;
-    size_t q_size = (q->offset % 8 == 0) ? q->offset / 8 : q->offset/8 + 1;
-    uint8_t shift = p->offset  % 8;
-
-    p->buf[idx] |= q->buf[0] >> shift;
-    idx++;
+void parallel_compressor_estimate_bits(struct parallel_compressor *p) {
+    struct container *c = p->container;
+    struct parallel_compressor_stats *stats = &p->stats;
 
-    for (size_t i = 0; i < q_size - 1; i++) {
-        p->buf[idx + i] = q->buf[i] << (8 - shift) | q->buf[i+1] >> shift;
+    uint64_t frequencies[256] = {0};
+    stats->sampled = 0;
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        for (size_t i = 0; i < 256; i++) {
+            frequencies[i] += c->histograms[b * 256 + i];
+            stats->sampled += c->histograms[b * 256 + i];
+        }
     }
 
-    p->buf[idx + q_size - 1] = q->buf[q_size - 1] << (8 - shift);
-    p->offset += q->offset;
-}
+    // the estimate uses the distribution the code was built for, which
+    // includes the +1 that container_build_code gives every symbol of a sample
+    int sampled = stats->sampled != p->in_size;
+    double bits = 0, total = 0;
+    for (size_t i = 0; i < 256; i++) {
+        uint64_t f = frequencies[i] + sampled;
+        total += f;
+        bits += (double) f * c->dict[i].bit_length;
+    }
 
-void test_bitstream_append() {
-    struct bitstream *a = bitstream_new(16);
-    struct bitstream *b = bitstream_new(16);
-    bitstream_push_chunk(a, 0b11110111, 8);
-    bitstream_push_chunk(a, 0b000, 3);
-    bitstream_push_chunk(b, 0b11111, 5);
-    bitstream_push_chunk(b, 0b11111111, 8);
-    bitstream_append(a, b);
-    assert(a->buf[0] == 0b11110111);
-    assert(a->buf[1] == 0b00011111);
-    assert(a->buf[2] == 0b11111111);
-    bitstream_print(a);
+    stats->sample_rate = p->in_size ? (double) stats->sampled / p->in_size : 1.0;
+    stats->estimated_bits = total ? bits / total : 0;
 }
 
-struct parallel_compressor* parallel_compressor_new(uint8_t *input, size_t size) {
-    struct parallel_compressor *p = calloc(1, sizeof(*p));
-    p->dict = calloc(256, sizeof(struct hfcode));
-    p->in = input;
-    p->in_size = size;
-    p->ostream = bitstream_new(size);
-    return p;
-}
+void parallel_compressor_measure_loss(struct parallel_compressor *p) {
+    struct container *c = p->container;
+    struct parallel_compressor_stats *stats = &p->stats;
+
+    // only the intervals that ended up Huffman coded are measured, along with
+    // the part of the sample that came from them
+    uint64_t frequencies[256] = {0};
+    uint64_t symbols = 0, bits = 0, sampled = 0;
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        if (c->modes[b] != BLOCK_HUFFMAN) {
+            continue;
+        }
+        symbols += container_block_length(c, b);
+        bits += c->blocks[b]->offset;
+        for (size_t i = 0; i < 256; i++) {
+            frequencies[i] += c->histograms[b * 256 + i];
+            sampled += c->histograms[b * 256 + i];
+        }
+    }
 
-void parallel_compressor_destroy(struct parallel_compressor *p) {
-    bitstream_destroy(p->ostream);
-    free(p);
-}
+    stats->actual_bits = symbols ? (double) bits / symbols : 0;
+    stats->loss_bound = 0;
+    if (stats->sampled == p->in_size || sampled == 0 || bits == 0) {
+        return;
+    }
 
-void parallel_compressor_generate_frequency_table(struct parallel_compressor *p, uint64_t *frequencies) {
-    memset(frequencies, 0, 256 * sizeof(uint64_t));
-    int threads = omp_get_max_threads();
-    size_t i;
-    #pragma omp parallel num_threads(threads) private(i) shared(p, frequencies)
-    {
-        uint64_t local_frequencies[256] = {0};
-        #pragma omp for schedule(static)
-        for (i = 0; i < p->in_size; i++) {
-            uint8_t byte = p->in[i];
-            local_frequencies[byte]++;
+    // a code built from the exact histogram cannot beat the entropy H(p) of the
+    // real distribution, so at most actual_bits - H(p) bits per symbol are lost
+    // to sampling. H(p) is bounded from below through the sampled distribution q:
+    // bytes within a window are strongly correlated, so the independent draws are
+    // the m windows (each at a random offset in its own stratum, see
+    // container_sample_block), not the bytes. Changing one window moves q by at
+    // most 2/m in L1 norm, so by McDiarmid's inequality |q - p|_1 <= eps =
+    // 16/sqrt(m) + sqrt(2 ln(1/delta) / m) with probability 1 - delta (16 =
+    // sqrt(256 symbols) bounds the expected deviation), and then by the
+    // continuity of the entropy (Audenaert), with T = eps/2 the total variation,
+    // H(p) >= H(q) - T log2(255) - h(T)
+    const double delta = 0.01;
+    double m = ceil((double) sampled / CONTAINER_SAMPLE_WINDOW);
+    double t = (16 / sqrt(m) + sqrt(2 * log(1.0 / delta) / m)) / 2;
+    double entropy = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (frequencies[i]) {
+            double q = (double) frequencies[i] / sampled;
+            entropy -= q * log2(q);
         }
+    }
 
-        // printf("collecting results from thread %d\n", tid);
-        #pragma omp critical
-        {
-            for (i = 0; i < 256; i++) {
-                frequencies[i] += local_frequencies[i];
-            }
-        }
+    double lower = 0;
+    if (t < 1 - 1.0 / 256) {
+        lower = entropy - t * log2(255) + t * log2(t) + (1 - t) * log2(1 - t);
+    }
+    if (lower < 0) {
+        lower = 0;
     }
+
+    // a lower bound of 0 means nothing is known: everything may have been lost
+    double loss = (stats->actual_bits - lower) / stats->actual_bits;
+    stats->loss_bound = loss < 0 ? 0 : loss > 1 ? 1 : loss;
 }
 
 void parallel_compressor_digest(struct parallel_compressor *p) {
-    uint64_t frequencies[256];
-    parallel_compressor_generate_frequency_table(p, frequencies);
+    struct container *c = p->container;
 
-    struct hftree *tree = hftree_new(frequencies);
-    hftree_generate_dict(tree, p->dict);
-    
-    size_t threads = omp_get_max_threads();
-    // printf("available threads: %lu\n", threads);
-    struct bitstream* ostreams[threads];
-
-    // allocate buffers for each thread
-    for (size_t i = 0; i < threads; i++) {
-        ostreams[i] = bitstream_new(2 * p->in_size / threads);
-    }
+    parallel_compressor_generate_frequency_table(p);
+    container_build_code(c);
+    parallel_compressor_estimate_bits(p);
 
     // the compression itself starts here
     double start = omp_get_wtime();
-    
-    // each thread compresses a chunk of the input into
-    // a separate buffer (bitstream)
-    #pragma omp parallel num_threads(threads)
-    {
-        #pragma omp for schedule(static)
-        for (size_t i = 0; i < p->in_size; i++) {
-            int tid = omp_get_thread_num();
-            // printf("thread %d: %lu\n", tid, i);
-            // printf("currently at %lu bytes\n", i);
-            uint8_t byte = p->in[i];
-            struct hfcode t = p->dict[byte];
-            // printf("(%lu) pushing 0x%02x -> 0b%b:%u to bitstream %d\n", i, byte, t.code, t.bit_length, tid);
-            bitstream_push_chunk(ostreams[tid], t.code, t.bit_length);
-        }
+
+    // each checkpoint interval is compressed into a separate buffer (bitstream),
+    // starting from an empty bit buffer, so it can later be decoded on its own;
+    // with a single thread no parallel region is entered at all
+    #pragma omp parallel for schedule(dynamic) num_threads(p->threads) if(p->threads > 1)
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        container_encode_block(c, p->in, b);
     }
 
     // compression is over
@@ -194,18 +164,23 @@ void parallel_compressor_digest(struct parallel_compressor *p) {
     // output duration to stdout
     printf("%.6f\n", duration);
 
-    for (size_t i = 0; i < threads; i++) {
-        bitstream_append(p->ostream, ostreams[i]);
-        // printf("bitstream %lu has offset %lu\n", i, ostreams[i]->offset);
-        // bitstream_print(ostreams[i]);
+    // the encoded sizes are exact now, so the sampling loss can be measured
+    // (before container_finish frees the histograms and the encoded blocks)
+    parallel_compressor_measure_loss(p);
+
+    // lay the intervals out back to back and record where each one starts
+    container_finish(c);
+
+    for (uint64_t b = 0; b < c->block_count; b++) {
+        p->stats.modes[c->modes[b]]++;
     }
 
-    // bitstream_print(p->ostream);
-    // printf("total offset: %lu\n", p->ostream->offset);
-    // printf("compression: %2fx\n", p->in_size / (p->ostream->offset/8.0));
+    // printf("total size: %lu\n", c->offsets[c->block_count]);
+    // printf("compression: %2fx\n", p->in_size / (double) c->offsets[c->block_count]);
 }
 
-void test_parallel_compression(char *filename) {
+void test_parallel_compression(char *filename, int threads, uint32_t checkpoint_interval,
+                               double sample_rate, int lz77) {
     FILE *file = fopen(filename, "r+b");
     if (!file) {
         fprintf(stderr, "failed to open file %s: %s\n", filename, strerror(errno));
@@ -226,28 +201,152 @@ void test_parallel_compression(char *filename) {
     // printf("read %lu bytes from %s\n", read, filename);
     fclose(file);
 
-    struct parallel_compressor *p = parallel_compressor_new(buf, read);
+    // pick whatever was not given on the command line from the cost model;
+    // this has to happen before the first parallel region
+    if (threads == 0 || checkpoint_interval == 0) {
+        struct autotune *tune = autotune_load();
+        struct autotune_plan plan = autotune_plan(tune, read);
+        threads = threads ? threads : plan.threads;
+        checkpoint_interval = checkpoint_interval ? checkpoint_interval : plan.block_size;
+        fprintf(stderr, "plan: %d threads, %u-byte intervals (serial below %zu bytes)\n",
+                threads, checkpoint_interval, autotune_serial_cutoff(tune));
+        autotune_destroy(tune);
+    }
+
+    struct parallel_compressor *p = parallel_compressor_new(buf, read, threads, checkpoint_interval,
+                                                            sample_rate, lz77);
     parallel_compressor_digest(p);
 
+    // stdout only carries the timing, the rest goes to stderr
+    struct parallel_compressor_stats *stats = &p->stats;
+    fprintf(stderr, "histogram: %.2f%% of the input sampled, %.3f bits/symbol estimated",
+            100 * stats->sample_rate, stats->estimated_bits);
+    if (stats->actual_bits > 0) {
+        fprintf(stderr, ", %.3f actual", stats->actual_bits);
+    }
+    if (stats->loss_bound > 0) {
+        fprintf(stderr, ", ratio loss <= %.3f%%", 100 * stats->loss_bound);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "intervals: %lu huffman, %lu raw, %lu rle, %lu lz77\n",
+            stats->modes[BLOCK_HUFFMAN], stats->modes[BLOCK_RAW], stats->modes[BLOCK_RLE],
+            stats->modes[BLOCK_LZ77]);
+
     file = fopen("out/parallel.out", "wb");
     if (!file) {
         fprintf(stderr, "failed to open file out/parallel.out: %s\n", strerror(errno));
         exit(1);
     }
 
-    size_t size = (p->ostream->offset % 8 == 0) ? p->ostream->offset / 8 : p->ostream->offset / 8 + 1;
-    // printf("writing %lu bytes to disk\n", size);
-    fwrite(p->ostream->buf, 1, size, file);
+    container_write(p->container, file);
+    fclose(file);
+
+    parallel_compressor_destroy(p);
+    free(buf);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: ./parallel_compression <filename>\n");
+void test_decompress_range(char *filename, uint64_t offset, uint64_t length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    struct container *c = container_read(file);
+    fclose(file);
+    if (!c) {
+        fprintf(stderr, "%s is not a compressed container\n", filename);
+        exit(1);
+    }
+
+    if (offset > c->size || length > c->size - offset) {
+        fprintf(stderr, "range [%lu, %lu) is out of bounds (size is %lu)\n",
+                offset, offset + length, c->size);
+        exit(1);
+    }
+
+    uint8_t *out = malloc(length + 1);
+    uint8_t *corrupted = calloc(c->block_count + 1, 1);
+    int64_t failed = container_decompress_range(c, offset, length, out, corrupted);
+    assert(failed >= 0);
+    if (failed > 0) {
+        for (uint64_t b = 0; b < c->block_count; b++) {
+            if (corrupted[b]) {
+                uint64_t start = b * c->block_size;
+                fprintf(stderr, "%s is corrupted: block %lu (bytes %lu to %lu) failed its checksum\n",
+                        filename, b, start, start + container_block_length(c, b));
+            }
+        }
         exit(1);
     }
+    free(corrupted);
+    fwrite(out, 1, length, stdout);
+
+    free(out);
+    container_destroy(c);
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./parallel_compression [-t <threads>] [-k <checkpoint interval>] [-s <sample percent>] [-z] <filename>\n");
+    fprintf(stderr, "       ./parallel_compression -d <container> <offset> <length>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    // zero means "let the cost model decide"
+    int threads = 0;
+    uint32_t checkpoint_interval = 0;
+    double sample_rate = 1.0;
+    int decompress = 0;
+    int lz77 = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:k:s:zd")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                usage();
+            }
+            break;
+        case 'k':
+            checkpoint_interval = strtoul(optarg, NULL, 10);
+            if (checkpoint_interval == 0) {
+                usage();
+            }
+            break;
+        case 's':
+            sample_rate = strtod(optarg, NULL) / 100;
+            if (sample_rate <= 0 || sample_rate > 1) {
+                usage();
+            }
+            break;
+        case 'z':
+            lz77 = 1;
+            break;
+        case 'd':
+            decompress = 1;
+            break;
+        default:
+            usage();
+        }
+    }
 
     // test_bitstream_push_chunk();
     // test_bitstream_append();
 
-    test_parallel_compression(argv[1]);
+    if (decompress) {
+        if (argc - optind != 3) {
+            usage();
+        }
+        test_decompress_range(argv[optind], strtoull(argv[optind + 1], NULL, 10),
+                              strtoull(argv[optind + 2], NULL, 10));
+        return 0;
+    }
+
+    if (argc - optind != 1) {
+        usage();
+    }
+
+    test_parallel_compression(argv[optind], threads, checkpoint_interval, sample_rate, lz77);
 }
@@ -1,5 +1,6 @@
 #include "serial_compression.h"
 #include "huffman.h"
+#include "bitstream.h"
 
 #include <errno.h>
 #include <omp.h>
@@ -7,84 +8,6 @@
 #include <string.h>
 #include <assert.h>
 
-struct bitstream* bitstream_new(size_t capacity) {
-    struct bitstream *p = malloc(sizeof(struct bitstream));
-    p->buf = calloc(capacity, 1);
-    p->capacity = capacity;
-    p->length = 0;
-    p->offset = 0;
-
-    return p;
-}
-
-void bitstream_destroy(struct bitstream *p) {
-    free(p->buf);
-    free(p);
-}
-
-// 1 byte chunks
-// TODO: should probably inline this
-void bitstream_push_chunk(struct bitstream *p, uint8_t chunk, uint8_t bit_length) {
-    // how many bits between the stream's current offset and the next byte boundary
-    uint64_t byte_offset = p->offset / 8;
-    uint8_t offset_within_byte = p->offset % 8;
-    uint8_t last_byte = p->buf[byte_offset];
-
-    /**
-     *
-     *      offset_within_byte
-     *        |----------|                               chunk we'd like to push
-     *         1   1   0   _   _   _   _   _          1   1   1   0   1   1   1   _
-     *        |-----------------------------|        |-----------------------------|
-     *                  8 bits
-     *
-     *        how to merge these (considering the push might cross the byte boundary)?
-     *        we expand both to 16 bits, right shift our chunk by offset_within_bytes bits,
-     *        OR both parts together and then convert back to two 8-bit chunks:
-     *
-     *                   original byte chunk expanded to 16 bits
-     *       |-------------------------------------------------------------|
-     *        1   1   0   _   _   _   _   _ | _   _   _   _   _   _   _   _
-     *        0   0   0   1   1   1   0   1 | 1   1   _   _   _   _   _   _
-     *                   |-------------------------|
-     *                  out chunk expanded to 16 bits
-     *           and shifted offset_within_byte = 3 units to the right
-     *
-     */
-    
-    uint16_t expanded_original_byte = last_byte << 8;
-    uint16_t expanded_and_shifted_chunk = (chunk << (16 - bit_length)) >> offset_within_byte;
-    uint16_t result = expanded_original_byte | expanded_and_shifted_chunk;
-
-    // we now push the two resulting bytes to the end of our buffer
-    // the mask might be redundant because of the cast but better safe than sorry
-    p->buf[byte_offset] = (uint8_t) (result >> 8);
-    p->buf[byte_offset + 1] = (uint8_t) (result & 0xFF);
-    p->offset += bit_length;
-    // printf("bitstream currently at offset=%lu (grew %u bits)\n", p->offset, bit_length);
-}
-
-void test_bitstream_push_chunk() {
-    struct bitstream *p = bitstream_new(16);
-    bitstream_push_chunk(p, 0b1101, 4);
-    assert(p->buf[0] == 0b11010000);
-    assert(p->offset == 4);
-    bitstream_push_chunk(p, 0b111111, 6);
-    assert(p->buf[0] == 0b11011111 && p->buf[1] == 0b11000000);
-    assert(p->offset == 10);
-    bitstream_destroy(p);
-}
-
-void bitstream_print(struct bitstream *p) {
-    printf("offset=%lu\n", p->offset);
-    printf("[ ");
-    size_t size = (p->offset % 8 == 0) ? p->offset / 8 : p->offset / 8 + 1;
-    for (uint64_t i = 0; i < size; i++) {
-        printf("%08b ", p->buf[i]);
-    }
-    printf("]\n");
-}
-
 struct serial_compressor* serial_compressor_new(uint8_t *input, size_t size) {
     struct serial_compressor *p = calloc(1, sizeof(*p));
     p->dict = calloc(256, sizeof(struct hfcode));
@@ -165,7 +88,7 @@ void test_serial_compression(char *filename) {
         exit(1);
     }
 
-    size_t size = (p->ostream->offset % 8 == 0) ? p->ostream->offset / 8 : p->ostream->offset / 8 + 1;
+    size_t size = bitstream_size(p->ostream);
     // printf("writing %lu bytes to disk\n", size);
     fwrite(p->ostream->buf, 1, size, file);
 }
@@ -0,0 +1,437 @@
+#include "wide_compression.h"
+#include "huffman.h"
+#include "bitstream.h"
+#include "crc32c.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+// the per-thread shards use 32-bit counters (half the cache footprint of
+// 64-bit ones), so they are flushed at least every 2^32 - 1 symbols
+#define WIDE_HISTOGRAM_CHUNK ((size_t) UINT32_MAX)
+
+struct wide_compressor* wide_compressor_new(uint8_t *input, size_t len, uint32_t block_size) {
+    struct wide_compressor *p = calloc(1, sizeof(*p));
+    p->in = (uint16_t *) input;
+    p->in_size = len / 2;
+    p->has_tail = len % 2;
+    p->tail = p->has_tail ? input[len - 1] : 0;
+
+    p->block_size = block_size;
+    p->block_count = (p->in_size + block_size - 1) / block_size;
+
+    p->frequencies = calloc(WIDE_SYMBOLS, sizeof(uint64_t));
+    p->dict = calloc(WIDE_SYMBOLS, sizeof(struct hfcode));
+    p->blocks = calloc(p->block_count, sizeof(struct bitstream *));
+    p->offsets = calloc(p->block_count + 1, sizeof(uint64_t));
+    p->checksums = calloc(p->block_count, sizeof(uint32_t));
+    return p;
+}
+
+void wide_compressor_destroy(struct wide_compressor *p) {
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        if (p->blocks[b]) {
+            bitstream_destroy(p->blocks[b]);
+        }
+    }
+
+    free(p->frequencies);
+    free(p->dict);
+    free(p->blocks);
+    free(p->offsets);
+    free(p->checksums);
+    free(p->payload);
+    free(p);
+}
+
+void wide_compressor_generate_frequency_table(struct wide_compressor *p) {
+    int threads = omp_get_max_threads();
+    uint32_t *shards = calloc((size_t) threads * WIDE_SYMBOLS, sizeof(uint32_t));
+
+    for (size_t base = 0; base < p->in_size; base += WIDE_HISTOGRAM_CHUNK) {
+        size_t end = p->in_size - base > WIDE_HISTOGRAM_CHUNK ? base + WIDE_HISTOGRAM_CHUNK : p->in_size;
+
+        #pragma omp parallel num_threads(threads)
+        {
+            // each thread counts its chunk of the input into its own shard...
+            uint32_t *local = shards + (size_t) omp_get_thread_num() * WIDE_SYMBOLS;
+            #pragma omp for schedule(static)
+            for (size_t i = base; i < end; i++) {
+                local[p->in[i]]++;
+            }
+
+            // ...and then every thread reduces a slice of the alphabet across
+            // all shards, so the merge is parallel as well
+            #pragma omp for schedule(static)
+            for (size_t s = 0; s < WIDE_SYMBOLS; s++) {
+                uint64_t sum = 0;
+                for (int t = 0; t < threads; t++) {
+                    sum += shards[(size_t) t * WIDE_SYMBOLS + s];
+                    shards[(size_t) t * WIDE_SYMBOLS + s] = 0;
+                }
+                p->frequencies[s] += sum;
+            }
+        }
+    }
+
+    free(shards);
+}
+
+void wide_compressor_digest(struct wide_compressor *p) {
+    double start = omp_get_wtime();
+    wide_compressor_generate_frequency_table(p);
+    double histogram_duration = omp_get_wtime() - start;
+
+    // code construction: sort-based lengths, then canonical codes
+    start = omp_get_wtime();
+    uint8_t *lengths = malloc(WIDE_SYMBOLS);
+    hflengths_build(p->frequencies, WIDE_SYMBOLS, lengths, HFCODE_MAX_BITS);
+
+    uint8_t longest = 0;
+    size_t used = 0;
+    for (size_t s = 0; s < WIDE_SYMBOLS; s++) {
+        p->dict[s].bit_length = lengths[s];
+        longest = lengths[s] > longest ? lengths[s] : longest;
+        used += lengths[s] != 0;
+    }
+    hfcode_canonicalize(p->dict, WIDE_SYMBOLS);
+    free(lengths);
+    double code_duration = omp_get_wtime() - start;
+
+    // the compression itself starts here
+    start = omp_get_wtime();
+
+    #pragma omp parallel for schedule(dynamic)
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        uint64_t first = b * p->block_size;
+        uint64_t last = first + p->block_size < p->in_size ? first + p->block_size : p->in_size;
+
+        // each chunk is checksummed right before it is encoded
+        struct bitstream *ostream = bitstream_new((last - first) * longest / 8 + 1);
+        uint32_t checksum = 0;
+        for (uint64_t c = first; c < last; c += WIDE_CHECKSUM_CHUNK) {
+            uint64_t end = c + WIDE_CHECKSUM_CHUNK < last ? c + WIDE_CHECKSUM_CHUNK : last;
+            checksum = crc32c_update(checksum, (const uint8_t *) (p->in + c), (end - c) * 2);
+            for (uint64_t i = c; i < end; i++) {
+                struct hfcode t = p->dict[p->in[i]];
+                bitstream_push_chunk(ostream, t.code, t.bit_length);
+            }
+        }
+        if (b == p->block_count - 1 && p->has_tail) {
+            checksum = crc32c_update(checksum, &p->tail, 1);
+        }
+        p->blocks[b] = ostream;
+        p->checksums[b] = checksum;
+    }
+
+    // compression is over
+    double duration = omp_get_wtime() - start;
+    // output duration to stdout
+    printf("%.6f\n", duration);
+    fprintf(stderr, "histogram: %.6f s, code construction: %.6f s (%lu symbols, longest code %u bits)\n",
+            histogram_duration, code_duration, used, longest);
+
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        p->offsets[b + 1] = p->offsets[b] + bitstream_size(p->blocks[b]);
+    }
+
+    p->payload = calloc(p->offsets[p->block_count] + BITSTREAM_PADDING, 1);
+    #pragma omp parallel for schedule(static)
+    for (uint64_t b = 0; b < p->block_count; b++) {
+        memcpy(p->payload + p->offsets[b], p->blocks[b]->buf, bitstream_size(p->blocks[b]));
+        bitstream_destroy(p->blocks[b]);
+        p->blocks[b] = NULL;
+    }
+}
+
+// checksum of everything before the payload, in file order
+static uint32_t wide_index_checksum(uint32_t block_size, uint64_t size, uint64_t block_count,
+                                    uint8_t has_tail, uint8_t tail, const uint8_t *lengths,
+                                    const uint64_t *offsets, const uint32_t *checksums) {
+    uint32_t crc = crc32c_update(0, (const uint8_t *) WIDE_MAGIC, 4);
+    crc = crc32c_update(crc, (const uint8_t *) &block_size, sizeof(block_size));
+    crc = crc32c_update(crc, (const uint8_t *) &size, sizeof(size));
+    crc = crc32c_update(crc, (const uint8_t *) &block_count, sizeof(block_count));
+    crc = crc32c_update(crc, &has_tail, 1);
+    crc = crc32c_update(crc, &tail, 1);
+    crc = crc32c_update(crc, lengths, WIDE_SYMBOLS);
+    crc = crc32c_update(crc, (const uint8_t *) offsets, (block_count + 1) * sizeof(uint64_t));
+    return crc32c_update(crc, (const uint8_t *) checksums, block_count * sizeof(uint32_t));
+}
+
+void wide_compressor_write(struct wide_compressor *p, FILE *file) {
+    uint64_t size = p->in_size;
+    uint8_t *lengths = malloc(WIDE_SYMBOLS);
+    for (size_t s = 0; s < WIDE_SYMBOLS; s++) {
+        lengths[s] = p->dict[s].bit_length;
+    }
+
+    // every field is written in host byte order
+    fwrite(WIDE_MAGIC, 1, 4, file);
+    fwrite(&p->block_size, sizeof(p->block_size), 1, file);
+    fwrite(&size, sizeof(size), 1, file);
+    fwrite(&p->block_count, sizeof(p->block_count), 1, file);
+    fwrite(&p->has_tail, 1, 1, file);
+    fwrite(&p->tail, 1, 1, file);
+    fwrite(lengths, 1, WIDE_SYMBOLS, file);
+    fwrite(p->offsets, sizeof(uint64_t), p->block_count + 1, file);
+    fwrite(p->checksums, sizeof(uint32_t), p->block_count, file);
+
+    uint32_t index_checksum = wide_index_checksum(p->block_size, size, p->block_count, p->has_tail,
+                                                  p->tail, lengths, p->offsets, p->checksums);
+    fwrite(&index_checksum, sizeof(index_checksum), 1, file);
+    fwrite(p->payload, 1, p->offsets[p->block_count], file);
+
+    free(lengths);
+}
+
+uint8_t* wide_decompress(FILE *file, size_t *len, int64_t *failed,
+                         uint8_t **corrupted, uint64_t *blocks) {
+    char magic[4];
+    uint32_t block_size;
+    uint64_t size, block_count;
+    uint8_t has_tail, tail;
+    uint32_t index_checksum;
+
+    *failed = -1;
+    *corrupted = NULL;
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, WIDE_MAGIC, 4) != 0 ||
+        fread(&block_size, sizeof(block_size), 1, file) != 1 ||
+        fread(&size, sizeof(size), 1, file) != 1 ||
+        fread(&block_count, sizeof(block_count), 1, file) != 1 ||
+        fread(&has_tail, 1, 1, file) != 1 ||
+        fread(&tail, 1, 1, file) != 1) {
+        return NULL;
+    }
+
+    // the header is untrusted: the block count has to match the size (computed
+    // so that it cannot wrap), the index (an offset and a checksum per block)
+    // has to fit in what is left of the file, and since every code is at least
+    // one bit long, so does the payload of size symbols
+    long position = ftell(file);
+    long file_size = position >= 0 && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if (file_size < 0 || fseek(file, position, SEEK_SET) != 0) {
+        return NULL;
+    }
+    uint64_t remaining = (uint64_t) (file_size - position);
+    if (block_size == 0 || block_count != size / block_size + (size % block_size != 0) ||
+        block_count > remaining / (sizeof(uint64_t) + sizeof(uint32_t)) || size / 8 > remaining) {
+        return NULL;
+    }
+
+    uint8_t *lengths = malloc(WIDE_SYMBOLS);
+    uint64_t *offsets = malloc((block_count + 1) * sizeof(uint64_t));
+    uint32_t *checksums = malloc(block_count * sizeof(uint32_t) + 1);
+    if (!lengths || !offsets || !checksums ||
+        fread(lengths, 1, WIDE_SYMBOLS, file) != WIDE_SYMBOLS ||
+        fread(offsets, sizeof(uint64_t), block_count + 1, file) != block_count + 1 ||
+        fread(checksums, sizeof(uint32_t), block_count, file) != block_count ||
+        fread(&index_checksum, sizeof(index_checksum), 1, file) != 1 ||
+        index_checksum != wide_index_checksum(block_size, size, block_count, has_tail, tail,
+                                              lengths, offsets, checksums) ||
+        !hflengths_valid(lengths, WIDE_SYMBOLS, HFCODE_MAX_BITS)) {
+        free(lengths);
+        free(offsets);
+        free(checksums);
+        return NULL;
+    }
+
+    for (uint64_t b = 0; b < block_count; b++) {
+        if (offsets[b + 1] < offsets[b] || offsets[b + 1] > remaining) {
+            free(lengths);
+            free(offsets);
+            free(checksums);
+            return NULL;
+        }
+    }
+
+    // a corrupted block may overrun its end by up to one chunk of the longest codes
+    uint8_t *payload = calloc(offsets[block_count] + BITSTREAM_PADDING + WIDE_CHECKSUM_CHUNK * HFCODE_MAX_BITS / 8, 1);
+    if (!payload || fread(payload, 1, offsets[block_count], file) != offsets[block_count]) {
+        free(lengths);
+        free(offsets);
+        free(checksums);
+        free(payload);
+        return NULL;
+    }
+
+    struct hfdecoder *decoder = hfdecoder_new(lengths, WIDE_SYMBOLS);
+    uint8_t *out = malloc(size * 2 + 1);
+    if (!decoder || !out) {
+        if (decoder) {
+            hfdecoder_destroy(decoder);
+        }
+        free(lengths);
+        free(offsets);
+        free(checksums);
+        free(payload);
+        free(out);
+        return NULL;
+    }
+    uint8_t *flags = calloc(block_count + 1, 1);
+    if (!flags) {
+        hfdecoder_destroy(decoder);
+        free(lengths);
+        free(offsets);
+        free(checksums);
+        free(payload);
+        free(out);
+        return NULL;
+    }
+    int64_t failed_blocks = 0;
+
+    // each chunk is checksummed while it is still in L1
+    #pragma omp parallel for schedule(dynamic) reduction(+:failed_blocks)
+    for (uint64_t b = 0; b < block_count; b++) {
+        uint64_t first = b * block_size;
+        uint64_t last = first + block_size < size ? first + block_size : size;
+        uint64_t bits = (offsets[b + 1] - offsets[b]) * 8;
+        uint64_t bit_offset = 0;
+        uint32_t checksum = 0;
+
+        for (uint64_t c = first; c < last && bit_offset <= bits; c += WIDE_CHECKSUM_CHUNK) {
+            uint64_t n = c + WIDE_CHECKSUM_CHUNK < last ? WIDE_CHECKSUM_CHUNK : last - c;
+            uint16_t *symbols = (uint16_t *) out + c;
+            bit_offset = hfdecoder_decode16(decoder, payload + offsets[b], bit_offset, symbols, n);
+            checksum = crc32c_update(checksum, (const uint8_t *) symbols, n * 2);
+        }
+        if (b == block_count - 1 && has_tail) {
+            checksum = crc32c_update(checksum, &tail, 1);
+        }
+
+        flags[b] = bit_offset > bits || checksum != checksums[b];
+        failed_blocks += flags[b];
+    }
+
+    hfdecoder_destroy(decoder);
+    free(lengths);
+    free(offsets);
+    free(checksums);
+    free(payload);
+
+    *failed = failed_blocks;
+    if (failed_blocks > 0) {
+        *corrupted = flags;
+        *blocks = block_count;
+        free(out);
+        return NULL;
+    }
+    free(flags);
+
+    if (has_tail) {
+        out[size * 2] = tail;
+    }
+    *len = size * 2 + has_tail;
+    return out;
+}
+
+void test_wide_compression(char *filename, uint32_t block_size) {
+    FILE *file = fopen(filename, "r+b");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t filesize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // rounded up so that the input can be read as 16-bit symbols
+    uint8_t *buf = malloc(filesize + 2);
+    if (!buf) {
+        fprintf(stderr, "unable to allocate memory for reading the file\n");
+        exit(1);
+    }
+    size_t read = fread(buf, 1, filesize, file);
+    fclose(file);
+
+    struct wide_compressor *p = wide_compressor_new(buf, read, block_size);
+    wide_compressor_digest(p);
+
+    file = fopen("out/wide.out", "wb");
+    if (!file) {
+        fprintf(stderr, "failed to open file out/wide.out: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    wide_compressor_write(p, file);
+    fclose(file);
+
+    wide_compressor_destroy(p);
+    free(buf);
+}
+
+void test_wide_decompression(char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open file %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    size_t len;
+    int64_t failed;
+    uint8_t *corrupted;
+    uint64_t blocks;
+    uint8_t *out = wide_decompress(file, &len, &failed, &corrupted, &blocks);
+    fclose(file);
+    if (!out && failed > 0) {
+        for (uint64_t b = 0; b < blocks; b++) {
+            if (corrupted[b]) {
+                fprintf(stderr, "%s is corrupted: block %lu failed its checksum\n", filename, b);
+            }
+        }
+        free(corrupted);
+        exit(1);
+    }
+    if (!out) {
+        fprintf(stderr, "%s is not a 16-bit compressed stream\n", filename);
+        exit(1);
+    }
+
+    fwrite(out, 1, len, stdout);
+    free(out);
+}
+
+void usage() {
+    fprintf(stderr, "usage: ./wide_compression [-b <symbols per block>] <filename>\n");
+    fprintf(stderr, "       ./wide_compression -d <compressed file>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint32_t block_size = WIDE_DEFAULT_BLOCK_SIZE;
+    int decompress = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, NULL, 10);
+            if (block_size == 0) {
+                usage();
+            }
+            break;
+        case 'd':
+            decompress = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage();
+    }
+
+    if (decompress) {
+        test_wide_decompression(argv[optind]);
+    } else {
+        test_wide_compression(argv[optind], block_size);
+    }
+}